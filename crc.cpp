@@ -0,0 +1,188 @@
+/*
+    crc.cpp: data field CRCs, and correcting sectors read with CRC errors
+
+    Copyright (C) 2013 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include "crc.h"
+#include "disk.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#define CRC_POLY 0x1021
+
+// The most sets of bits correct_sector_data will try flipping. Each has
+// about a 1 in 65536 chance of matching the CRC by accident.
+#define MAX_FLIP_SETS 128
+
+// Slice-by-8 tables: table[k][b] is the CRC (from 0) of byte b followed by
+// k zero bytes, so eight bytes can be folded in at once.
+typedef struct {
+    uint16_t table[8][256];
+} crc_tables_t;
+
+static crc_tables_t make_crc_tables(void) {
+    crc_tables_t t;
+    for (int b = 0; b < 256; b++) {
+        uint16_t crc = b << 8;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ CRC_POLY : crc << 1;
+        }
+        t.table[0][b] = crc;
+    }
+    for (int k = 1; k < 8; k++) {
+        for (int b = 0; b < 256; b++) {
+            const uint16_t prev = t.table[k - 1][b];
+            t.table[k][b] = (prev << 8) ^ t.table[0][prev >> 8];
+        }
+    }
+    return t;
+}
+
+static const crc_tables_t& crc_tables(void) {
+    static const crc_tables_t tables = make_crc_tables();
+    return tables;
+}
+
+uint16_t crc16_ccitt(uint16_t crc, const uint8_t *data, size_t len) {
+    const crc_tables_t& t = crc_tables();
+    while (len >= 8) {
+        crc = t.table[7][data[0] ^ (crc >> 8)]
+              ^ t.table[6][data[1] ^ (crc & 0xFF)]
+              ^ t.table[5][data[2]] ^ t.table[4][data[3]]
+              ^ t.table[3][data[4]] ^ t.table[2][data[5]]
+              ^ t.table[1][data[6]] ^ t.table[0][data[7]];
+        data += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = (crc << 8) ^ t.table[0][(crc >> 8) ^ *data];
+        data++;
+        len--;
+    }
+    return crc;
+}
+
+uint16_t data_field_crc(bool is_fm, bool deleted, const uint8_t *data, size_t len) {
+    const uint8_t mark[] = { 0xA1, 0xA1, 0xA1, uint8_t(deleted ? 0xF8 : 0xFB) };
+    uint16_t crc = 0xFFFF;
+    if (is_fm) {
+        crc = crc16_ccitt(crc, mark + 3, 1);
+    } else {
+        crc = crc16_ccitt(crc, mark, 4);
+    }
+    return crc16_ccitt(crc, data, len);
+}
+
+// The CRC is linear, so flipping a bit in the data changes it by a fixed
+// amount that depends only on how far the bit is from the end.
+static uint16_t flip_syndrome(size_t len, size_t bit) {
+    const crc_tables_t& t = crc_tables();
+    uint16_t crc = t.table[0][0x80 >> (bit % 8)];
+    for (size_t i = bit / 8 + 1; i < len; i++) {
+        crc = (crc << 8) ^ t.table[0][crc >> 8];
+    }
+    return crc;
+}
+
+// Return the most bits there can be to suspect without there being more
+// than MAX_FLIP_SETS ways to flip one or two of them.
+static size_t max_suspects(void) {
+    size_t n = 0;
+    while ((n + 1) + (n + 1) * n / 2 <= MAX_FLIP_SETS) {
+        n++;
+    }
+    return n;
+}
+
+// Find the bits in data that the versions of a sector disagree on. Return
+// false if there are too many to try flipping all the pairs of.
+static bool find_suspects(const sector_t& sector, const data_t& data,
+                          std::vector<size_t>& suspects) {
+    const size_t max = max_suspects();
+    for (size_t pos = 0; pos < data.size(); pos++) {
+        uint8_t differ = 0;
+        for (size_t i = 0; i < sector.datas.size(); i++) {
+            if (sector.datas[i].length() == data.size()) {
+                differ |= sector.datas[i][pos] ^ data[pos];
+            }
+        }
+        for (int bit = 0; bit < 8; bit++) {
+            if (differ & (0x80 >> bit)) {
+                if (suspects.size() == max) return false;
+                suspects.push_back(pos * 8 + bit);
+            }
+        }
+    }
+    return true;
+}
+
+bool sector_correctable(const sector_t& sector) {
+    if (sector.datas.empty()) return false;
+
+    data_t data(sector.datas[0].data(), sector.datas[0].length());
+    std::vector<size_t> suspects;
+    return find_suspects(sector, data, suspects);
+}
+
+bool correct_sector_data(const sector_t& sector, bool is_fm, uint16_t crc,
+                         data_t& result) {
+    if (sector.datas.empty()) return false;
+
+    std::vector<bool> uncertain;
+    vote_sector_data(sector, result, uncertain);
+    const size_t len = result.size();
+    const uint16_t syndrome = data_field_crc(is_fm, sector.deleted, result.data(), len) ^ crc;
+    if (syndrome == 0) return true;
+
+    std::vector<size_t> suspects;
+    if (!find_suspects(sector, result, suspects)) return false;
+
+    std::vector<uint16_t> syndromes(suspects.size());
+    for (size_t i = 0; i < suspects.size(); i++) {
+        syndromes[i] = flip_syndrome(len, suspects[i]);
+    }
+
+    int matches = 0;
+    size_t flip[2] = { 0, 0 };
+    int num_flips = 0;
+    for (size_t i = 0; i < suspects.size(); i++) {
+        if (syndromes[i] == syndrome) {
+            matches++;
+            flip[0] = suspects[i];
+            num_flips = 1;
+        }
+        for (size_t j = i + 1; j < suspects.size(); j++) {
+            if ((syndromes[i] ^ syndromes[j]) == syndrome) {
+                matches++;
+                flip[0] = suspects[i];
+                flip[1] = suspects[j];
+                num_flips = 2;
+            }
+        }
+    }
+    if (matches != 1) return false;
+
+    for (int i = 0; i < num_flips; i++) {
+        result[flip[i] / 8] ^= 0x80 >> (flip[i] % 8);
+    }
+    return true;
+}
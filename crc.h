@@ -0,0 +1,58 @@
+/*
+    crc.h: data field CRCs, and correcting sectors read with CRC errors
+
+    Copyright (C) 2013 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+    The controller checks each data field against the CRC-16/CCITT written
+    after it (polynomial 0x1021, starting from 0xFFFF), which covers the
+    address mark as well as the data: A1 A1 A1 FB (or F8 if deleted) in MFM,
+    or just FB (F8) in FM. It's written high byte first.
+*/
+
+#ifndef CRC_H
+#define CRC_H
+
+#include "disk.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Continue a CRC-16/CCITT over some more data.
+uint16_t crc16_ccitt(uint16_t crc, const uint8_t *data, size_t len);
+
+// Compute the CRC of a data field, as it's written on the disk.
+uint16_t data_field_crc(bool is_fm, bool deleted, const uint8_t *data, size_t len);
+
+// Try to recover the data of a sector that's been read with CRC errors,
+// given the CRC written on the disk for it: look for a way of flipping no
+// more than two bits in the result of vote_sector_data that makes it match.
+// Only bits that the versions read disagree on are flipped, and only when
+// there are few enough of them that a match is very unlikely to be chance
+// -- a 16-bit CRC can't tell one or two bit errors anywhere in a sector
+// apart from bigger ones. Return false if there isn't exactly one match.
+bool correct_sector_data(const sector_t& sector, bool is_fm, uint16_t crc,
+                         data_t& result);
+
+// Return whether the versions of a sector read so far are close enough
+// together for correct_sector_data to have a chance of working -- once
+// they're not, reading more won't help.
+bool sector_correctable(const sector_t& sector);
+
+#endif
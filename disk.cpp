@@ -19,6 +19,7 @@
 */
 
 #include "disk.h"
+#include "kernels.h"
 #include "util.h"
 
 #include <assert.h>
@@ -26,8 +27,12 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <time.h>
 
+#include <algorithm>
+
 size_t sector_bytes(int code) {
     return 128 << code;
 }
@@ -55,6 +60,118 @@ const data_mode_t DATA_MODES[] = {
     { 0, NULL, 0, false } // NULL represents end of array.
 };
 
+const data_mode_t *find_data_mode(uint8_t imd_mode) {
+    for (int i = 0; DATA_MODES[i].name != NULL; i++) {
+        if (DATA_MODES[i].imd_mode == imd_mode) {
+            return &DATA_MODES[i];
+        }
+    }
+    return NULL;
+}
+
+void data_variant_t::assign(const uint8_t *data, size_t len) {
+    owned_.assign(data, len);
+    view_ = NULL;
+    length_ = len;
+    hashed_ = false;
+}
+
+void data_variant_t::assign_view(const uint8_t *data, size_t len) {
+    assert(data != NULL);
+    owned_.clear();
+    view_ = data;
+    length_ = len;
+    hashed_ = false;
+}
+
+uint8_t *data_variant_t::mutable_data() {
+    if (view_ != NULL) {
+        owned_.assign(view_, length_);
+        view_ = NULL;
+    }
+    hashed_ = false;
+    return &owned_[0];
+}
+
+uint64_t data_variant_t::hash() const {
+    if (!hashed_) {
+        hash_ = data_hash(data(), length_);
+        hashed_ = true;
+    }
+    return hash_;
+}
+
+bool data_variant_t::operator<(const data_variant_t& other) const {
+    const size_t len = std::min(length_, other.length_);
+    const int cmp = memcmp(data(), other.data(), len);
+    if (cmp != 0) return cmp < 0;
+    return length_ < other.length_;
+}
+
+void data_map_t::clear() {
+    first_ = data_variant_t();
+    rest_.clear();
+    size_ = 0;
+}
+
+data_variant_t *data_map_t::find(const uint8_t *data, size_t len) {
+    if (size_ == 0) return NULL;
+
+    const uint64_t hash = data_hash(data, len);
+    for (size_t i = 0; i < size_; i++) {
+        data_variant_t& variant = (*this)[i];
+        if (variant.length() == len
+            && variant.hash() == hash
+            && data_equal(variant.data(), data, len)) {
+            return &variant;
+        }
+    }
+    return NULL;
+}
+
+data_variant_t *data_map_t::find_hash(uint64_t hash, size_t len) {
+    for (size_t i = 0; i < size_; i++) {
+        data_variant_t& variant = (*this)[i];
+        if (variant.length() == len && variant.hash() == hash) {
+            return &variant;
+        }
+    }
+    return NULL;
+}
+
+// Add an empty variant at the end.
+data_variant_t& data_map_t::add(uint32_t count) {
+    if (size_ > 0) {
+        rest_.push_back(data_variant_t());
+    }
+    data_variant_t& added = (*this)[size_++];
+    added.count = count;
+    return added;
+}
+
+// Move the last variant down to its sorted position.
+// (Swapping doesn't copy the data.)
+static data_variant_t& sort_last(data_map_t& map) {
+    size_t pos = map.size() - 1;
+    while (pos > 0 && map[pos] < map[pos - 1]) {
+        std::swap(map[pos], map[pos - 1]);
+        pos--;
+    }
+    return map[pos];
+}
+
+data_variant_t& data_map_t::insert(const uint8_t *data, size_t len, uint32_t count) {
+    assert(find(data, len) == NULL);
+    add(count).assign(data, len);
+    return sort_last(*this);
+}
+
+data_variant_t& data_map_t::insert_view(const uint8_t *data, size_t len, uint32_t count) {
+    assert(find(data, len) == NULL);
+    add(count).assign_view(data, len);
+    return sort_last(*this);
+}
+
 void init_sector(sector_t& sector) {
     sector.status = SECTOR_MISSING;
     sector.log_cyl = 0xFF;
@@ -69,6 +186,96 @@ void assert_free_sector(const sector_t& sector) {
     assert(sector.datas.empty());
 }
 
+bool record_good_read(sector_t& sector, const uint8_t *data, size_t len,
+                      bool deleted, bool replace) {
+    sector.status = SECTOR_GOOD;
+    sector.deleted = deleted;
+
+    if (replace) {
+        sector.datas.clear();
+    }
+    if (sector.datas.find(data, len) != NULL) {
+        return false;
+    }
+    // Normally the '1' means we've seen this data 1 time now. But if we've
+    // ever seen anything else, this successful read should trump them all
+    // with the highest possible "seen count."
+    sector.datas.insert(data, len, sector.datas.empty() ? 1 : UINT32_MAX);
+    return true;
+}
+
+bool record_bad_read(sector_t& sector, const uint8_t *data, size_t len,
+                     bool deleted) {
+    sector.status = SECTOR_BAD;
+    sector.deleted = deleted;
+
+    data_variant_t *variant = sector.datas.find(data, len);
+    if (variant == NULL) {
+        sector.datas.insert(data, len, 1); // 1 meaning we've seen this data 1 time now.
+        return true;
+    }
+    if (variant->count != UINT32_MAX) {
+        variant->count++;
+    }
+    return false;
+}
+
+size_t vote_sector_data(const sector_t& sector, data_t& result,
+                        std::vector<bool>& uncertain) {
+    // Start from the most-read version, and vote with the others that are
+    // the same length.
+    size_t best = 0;
+    for (size_t i = 1; i < sector.datas.size(); i++) {
+        if (sector.datas[i].count > sector.datas[best].count) {
+            best = i;
+        }
+    }
+    const data_variant_t& base = sector.datas[best];
+    const size_t len = base.length();
+    result.assign(base.data(), len);
+    uncertain.assign(len, false);
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < sector.datas.size(); i++) {
+        if (sector.datas[i].length() == len) {
+            total += sector.datas[i].count;
+        }
+    }
+
+    size_t num_uncertain = 0;
+    for (size_t pos = 0; pos < len; pos++) {
+        // The weight of the reads with each bit set.
+        uint64_t ones[8] = {0};
+        for (size_t i = 0; i < sector.datas.size(); i++) {
+            const data_variant_t& variant = sector.datas[i];
+            if (variant.length() != len) continue;
+            const uint8_t byte = variant[pos];
+            for (int bit = 0; bit < 8; bit++) {
+                if (byte & (1 << bit)) {
+                    ones[bit] += variant.count;
+                }
+            }
+        }
+
+        uint8_t byte = 0;
+        for (int bit = 0; bit < 8; bit++) {
+            const uint64_t zeros = total - ones[bit];
+            if (ones[bit] > zeros || (ones[bit] == zeros && (base[pos] & (1 << bit)))) {
+                byte |= 1 << bit;
+            }
+            const uint64_t margin = ones[bit] > zeros ? ones[bit] - zeros : zeros - ones[bit];
+            if (margin < 2) {
+                uncertain[pos] = true;
+            }
+        }
+        result[pos] = byte;
+        if (uncertain[pos]) {
+            num_uncertain++;
+        }
+    }
+    return num_uncertain;
+}
+
 void init_track(int phys_cyl, int phys_head, track_t& track) {
     track.status = TRACK_UNKNOWN,
     track.data_mode = NULL,
@@ -76,9 +283,27 @@ void init_track(int phys_cyl, int phys_head, track_t& track) {
     track.phys_head = phys_head;
     track.num_sectors = 0;
     track.sector_size_code = UCHAR_MAX;
-    for (int i = 0; i < MAX_SECS; i++) {
+    track.sectors.clear();
+}
+
+void resize_track(track_t& track, int num_sectors) {
+    assert(num_sectors >= 0 && num_sectors < MAX_SECS);
+
+    const int old_size = track.sectors.size();
+    track.sectors.resize(num_sectors);
+    for (int i = old_size; i < num_sectors; i++) {
         init_sector(track.sectors[i]);
     }
+    track.num_sectors = num_sectors;
+}
+
+const uint8_t *get_fill_block(fill_blocks_t& blocks, uint8_t fill, size_t len) {
+    data_t& block = blocks[(len << 8) | fill];
+    if (block.empty()) {
+        block.resize(len);
+        data_fill(&block[0], fill, len);
+    }
+    return block.data();
 }
 
 void init_disk(disk_t& disk) {
@@ -87,20 +312,79 @@ void init_disk(disk_t& disk) {
     disk.num_phys_heads = 0;
     for (int cyl = 0; cyl < MAX_CYLS; cyl++) {
         for (int head = 0; head < MAX_HEADS; head++) {
-            init_track(cyl, head, disk.tracks[cyl][head]);
+            disk.tracks[cyl][head] = NULL;
         }
     }
+    disk.mapped = NULL;
+    disk.mapped_size = 0;
+    disk.fill_blocks.clear();
+}
+
+void free_disk(disk_t& disk) {
+    for (int cyl = 0; cyl < MAX_CYLS; cyl++) {
+        for (int head = 0; head < MAX_HEADS; head++) {
+            delete disk.tracks[cyl][head];
+            disk.tracks[cyl][head] = NULL;
+        }
+    }
+
+    if (disk.mapped != NULL) {
+        munmap(disk.mapped, disk.mapped_size);
+        disk.mapped = NULL;
+        disk.mapped_size = 0;
+    }
+    disk.fill_blocks.clear();
+}
+
+void move_disk(disk_t& from, disk_t& to) {
+    to.comment.swap(from.comment);
+    to.num_phys_cyls = from.num_phys_cyls;
+    to.num_phys_heads = from.num_phys_heads;
+    for (int cyl = 0; cyl < MAX_CYLS; cyl++) {
+        for (int head = 0; head < MAX_HEADS; head++) {
+            assert(to.tracks[cyl][head] == NULL);
+            to.tracks[cyl][head] = from.tracks[cyl][head];
+        }
+    }
+    assert(to.mapped == NULL);
+    to.mapped = from.mapped;
+    to.mapped_size = from.mapped_size;
+    // Swapping the maps keeps the blocks where they are, so views of them
+    // stay valid.
+    assert(to.fill_blocks.empty());
+    to.fill_blocks.swap(from.fill_blocks);
+
+    init_disk(from);
+}
+
+track_t& disk_track(disk_t& disk, int phys_cyl, int phys_head) {
+    assert(phys_cyl >= 0 && phys_cyl < MAX_CYLS);
+    assert(phys_head >= 0 && phys_head < MAX_HEADS);
+
+    track_t*& track = disk.tracks[phys_cyl][phys_head];
+    if (track == NULL) {
+        track = new track_t;
+        init_track(phys_cyl, phys_head, *track);
+    }
+    return *track;
+}
+
+const track_t *find_track(const disk_t& disk, int phys_cyl, int phys_head) {
+    if (phys_cyl < 0 || phys_cyl >= MAX_CYLS) return NULL;
+    if (phys_head < 0 || phys_head >= MAX_HEADS) return NULL;
+    return disk.tracks[phys_cyl][phys_head];
 }
 
 void make_disk_comment(const char *program, const char *version, disk_t& disk) {
     time_t now = time(NULL);
-    const struct tm *local = localtime(&now);
+    struct tm local;
+    localtime_r(&now, &local);
 
     disk.comment = str_sprintf(
         "%s %s: %02d/%02d/%04d %02d:%02d:%02d\r\n",
         program, version,
-        local->tm_mday, local->tm_mon + 1, local->tm_year + 1900,
-        local->tm_hour, local->tm_min, local->tm_sec);
+        local.tm_mday, local.tm_mon + 1, local.tm_year + 1900,
+        local.tm_hour, local.tm_min, local.tm_sec);
 }
 
 void copy_track_layout(const track_t& src, track_t& dest) {
@@ -108,7 +392,7 @@ void copy_track_layout(const track_t& src, track_t& dest) {
 
     dest.status = TRACK_GUESSED;
     dest.data_mode = src.data_mode;
-    dest.num_sectors = src.num_sectors;
+    resize_track(dest, src.num_sectors);
     dest.sector_size_code = src.sector_size_code;
 
     int cyl_diff = dest.phys_cyl - src.phys_cyl;
@@ -122,36 +406,6 @@ void copy_track_layout(const track_t& src, track_t& dest) {
     }
 }
 
-bool track_scan_sectors(const track_t& track, const sector_t** lowest) {
-    bool seen[MAX_SECS] = {false};
-
-    *lowest = NULL;
-    int lowest_id = MAX_SECS;
-    int highest_id = 0;
-    for (int i = 0; i < track.num_sectors; i++) {
-        const sector_t& sector = track.sectors[i];
-        const int id = sector.log_sector;
-        assert(id < MAX_SECS);
-        assert(!seen[id]); // How would we handle getting the same sector id twice?
-        seen[id] = true;
-
-        if (id < lowest_id) {
-            lowest_id = id;
-            *lowest = &sector;
-        }
-        if (id > highest_id) {
-            highest_id = id;
-        }
-    }
-
-    for (int i = lowest_id; i < highest_id; i++) {
-        if (!seen[i]) {
-            return false; // not contiguous
-        }
-    }
-    return true; // contiguous
-}
-
 bool same_sector_addr(const sector_t& a, const sector_t& b) {
     if (a.log_cyl != b.log_cyl) return false;
     if (a.log_head != b.log_head) return false;
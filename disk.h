@@ -43,8 +43,9 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#include <string>
 #include <map>
+#include <string>
+#include <vector>
 
 // Convert sector_size_code to size in bytes.
 size_t sector_bytes(int code);
@@ -60,6 +61,9 @@ typedef struct {
 // (The last has name == NULL.)
 extern const data_mode_t DATA_MODES[];
 
+// Find the data mode with a given IMD mode number, or NULL if there isn't one.
+const data_mode_t *find_data_mode(uint8_t imd_mode);
+
 typedef enum {
     SECTOR_MISSING = 0,
     SECTOR_BAD,
@@ -69,7 +73,81 @@ typedef enum {
 
 
 typedef std::basic_string<uint8_t> data_t; // Data bytes content of a particular sector read.
-typedef std::map<data_t, uint32_t> data_map_t;  // Data bytes maps to a counter of how many times we found that data.
+
+// One distinct data content read from a sector, with a counter of how many
+// times we found that data.
+//
+// The variant either owns its data, or is a view of memory owned by the disk
+// (such as a mapped image file). A view is copied into the variant the first
+// time its data is modified.
+class data_variant_t {
+public:
+    data_variant_t() : count(0), view_(NULL), length_(0), hashed_(false) {}
+
+    const uint8_t *data() const {
+        return view_ != NULL ? view_ : owned_.data();
+    }
+    size_t length() const { return length_; }
+    uint8_t operator[](size_t i) const { return data()[i]; }
+    bool is_view() const { return view_ != NULL; }
+
+    // Replace the contents with a copy of some data.
+    void assign(const uint8_t *data, size_t len);
+    // Replace the contents with a view of some data, which must stay valid
+    // and unchanged for as long as the variant refers to it.
+    void assign_view(const uint8_t *data, size_t len);
+    // Get a modifiable pointer to the data.
+    uint8_t *mutable_data();
+
+    // data_hash of the data, computed when first needed.
+    uint64_t hash() const;
+
+    // Compare contents, in the same order as data_t does.
+    bool operator<(const data_variant_t& other) const;
+
+    uint32_t count;
+
+private:
+    const uint8_t *view_;
+    data_t owned_;
+    size_t length_;
+    mutable uint64_t hash_;
+    mutable bool hashed_;
+};
+
+class data_map_t {
+public:
+    data_map_t() : size_(0) {}
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    void clear();
+
+    const data_variant_t& operator[](size_t i) const {
+        return i == 0 ? first_ : rest_[i - 1];
+    }
+    data_variant_t& operator[](size_t i) {
+        return i == 0 ? first_ : rest_[i - 1];
+    }
+
+    // Return the variant with the given content, or NULL if there isn't one.
+    data_variant_t *find(const uint8_t *data, size_t len);
+    // Return the variant with the given length and data_hash, or NULL.
+    data_variant_t *find_hash(uint64_t hash, size_t len);
+
+    // Add a variant, which must not already be present.
+    data_variant_t& insert(const uint8_t *data, size_t len, uint32_t count);
+    // Likewise, but as a view of the data rather than a copy (see
+    // data_variant_t::assign_view).
+    data_variant_t& insert_view(const uint8_t *data, size_t len, uint32_t count);
+
+private:
+    data_variant_t& add(uint32_t count);
+
+    data_variant_t first_;
+    std::vector<data_variant_t> rest_;
+    size_t size_;
+};
 
 typedef struct {
     sector_status_t status;
@@ -83,6 +161,23 @@ typedef struct {
 void init_sector(sector_t& sector);
 void assert_free_sector(const sector_t& sector);
 
+// Update a sector after a good read of its data. If replace is true, any
+// earlier reads of the sector are forgotten. Return whether this data
+// hadn't been seen before.
+bool record_good_read(sector_t& sector, const uint8_t *data, size_t len,
+                      bool deleted, bool replace);
+// Update a sector after a read that returned data with a bad CRC. Return
+// whether this data hadn't been seen before.
+bool record_bad_read(sector_t& sector, const uint8_t *data, size_t len,
+                     bool deleted);
+// Reconstruct the data of a sector that's been read several times with bad
+// CRCs, by a vote on each bit across the versions read, weighted by how
+// many times each was read; ties go to the most-read version. uncertain
+// gets a flag for each byte, set where the vote on one of its bits was won
+// by less than two reads. Return the number of uncertain bytes.
+size_t vote_sector_data(const sector_t& sector, data_t& result,
+                        std::vector<bool>& uncertain);
+
 typedef enum {
     TRACK_UNKNOWN = 0,
     TRACK_GUESSED,
@@ -98,21 +193,52 @@ typedef struct {
     uint8_t phys_head;
     uint8_t num_sectors;
     uint8_t sector_size_code; // FDC code
-    sector_t sectors[MAX_SECS]; // indexed by physical sector
+    std::vector<sector_t> sectors; // indexed by physical sector
 } track_t;
 
 void init_track(const int phys_cyl, const int phys_head, track_t& track);
 
+// Set the number of sectors in a track. New sectors are initialised; sectors
+// beyond the new count are discarded.
+void resize_track(track_t& track, int num_sectors);
+
+// Blocks of one repeated byte, keyed by (size << 8) | byte.
+typedef std::map<size_t, data_t> fill_blocks_t;
+
+// Get a block of len copies of fill, which stays valid as long as blocks does.
+const uint8_t *get_fill_block(fill_blocks_t& blocks, uint8_t fill, size_t len);
+
 #define MAX_CYLS 256
 #define MAX_HEADS 2
 typedef struct {
     std::string comment;
     int num_phys_cyls;
     int num_phys_heads;
-    track_t tracks[MAX_CYLS][MAX_HEADS]; // indexed by physical cyl/head
+    // Indexed by physical cyl/head. Tracks are allocated the first time
+    // they're asked for, so this is NULL for tracks we know nothing about.
+    track_t *tracks[MAX_CYLS][MAX_HEADS];
+
+    // A mapped image file that sector data may be a view of.
+    void *mapped;
+    size_t mapped_size;
+    // Blocks of repeated bytes that sector data may be a view of.
+    fill_blocks_t fill_blocks;
 } disk_t;
 
+// init_disk must be called before a disk is used, and free_disk once it's
+// finished with.
 void init_disk(disk_t& disk);
+void free_disk(disk_t& disk);
+
+// Hand everything in from, including what its sector data may be a view of,
+// over to to (which must be empty), and leave from empty.
+void move_disk(disk_t& from, disk_t& to);
+
+// Get a track from a disk, allocating it if it doesn't exist yet.
+track_t& disk_track(disk_t& disk, int phys_cyl, int phys_head);
+
+// Get a track from a disk, or NULL if it hasn't been allocated.
+const track_t *find_track(const disk_t& disk, int phys_cyl, int phys_head);
 
 // Create a ImageDisk-style timestamp comment.
 void make_disk_comment(const char *program, const char *version, disk_t& disk);
@@ -120,10 +246,6 @@ void make_disk_comment(const char *program, const char *version, disk_t& disk);
 // Copy the layout of a track from another track on the same head.
 void copy_track_layout(const track_t& src, track_t& dest);
 
-// Find the sectors with the lowest and highest logical IDs in a track,
-// and whether the sectors have contiguous logical IDs.
-bool track_scan_sectors(const track_t& track, const sector_t **lowest);
-
 // Return whether two sectors have the same logical address.
 bool same_sector_addr(const sector_t& a, const sector_t& b);
 
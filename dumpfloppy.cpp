@@ -24,8 +24,14 @@
       http://www.fdutils.linux.lu/disk-id.html
 */
 
+#include "crc.h"
 #include "disk.h"
+#include "fdc.h"
 #include "imd.h"
+#include "imdx.h"
+#include "journal.h"
+#include "kernels.h"
+#include "trackwriter.h"
 #include "util.h"
 
 #include <assert.h>
@@ -33,18 +39,26 @@
 #include <limits.h>
 #include <linux/fd.h>
 #include <linux/fdreg.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-static struct args {
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+// Each drive is imaged by its own thread, so everything from here down to
+// geometry is per-thread. args is copied from the options for each drive.
+static thread_local struct args {
     bool always_probe;
     int drive;
     int tracks;
@@ -53,12 +67,73 @@ static struct args {
     int ignore_sector;
     const char *image_filename;
     int max_tries;
+    int confidence;
     bool retry;
+    const char *simulate;
+    const char *record_trace;
+    const char *replay_trace;
 } args;
-static int dev_fd;
+static thread_local fdc_t fdc;
+// When retrying, reads are appended to this rather than rewriting the image.
+static thread_local journal_t journal;
+// Where status output goes.
+static thread_local FILE *status_out;
+// The new image being written as the disk's read, when not retrying:
+// filename is the .in_progress file until it's been renamed over the image
+// (and empty otherwise), and writing says whether the track writer's
+// running.
+static thread_local struct {
+    std::string filename;
+    int fd;
+    bool writing;
+    track_writer_t writer;
+} image_out;
+
+// Where the head is, so sectors can be read in the order they come round
+// rather than physical order: next_sec is the physical index of the next
+// sector to reach the head on track, if track isn't NULL.
+static thread_local struct {
+    const track_t *track;
+    int next_sec;
+} head_pos;
+// How long it takes between one command finishing and the next one being
+// able to read a sector. This is learned from reads that just miss their
+// sector, and have to wait for it to come round again.
+static thread_local double turnaround_time = 0.0;
+
+// What probing has found out about data modes on this disk, as indexes into
+// DATA_MODES: the mode that worked on the last track probed (or -1), a bit
+// set for each mode that's failed on it or the tracks before it, and how
+// many tracks each mode has worked on. Neighbouring tracks are nearly
+// always in the same mode, and most disks only use one or two modes.
+static thread_local struct {
+    int good;
+    unsigned int failed;
+    int good_count[8 * sizeof(unsigned int)];
+} probe_hint = { -1, 0, {} };
+
+// What we've learned about the disk's layout: for each physical head, the
+// track most recently probed or read there, which other tracks' layouts
+// are predicted from, and the track most recently probed; and how many
+// sectors the layout rotates by from one cylinder to the next.
+static thread_local struct {
+    const track_t *known[2];
+    const track_t *probed[2];
+    int skew;
+} geometry;
+
+// The CRCs written on the disk after the data of sectors that have been
+// read with CRC errors, by physical cylinder and head and the sector's ID
+// (see data_crc_key); and whether the controller's refused to read one, in
+// which case we stop trying.
+static thread_local struct {
+    std::map<uint64_t, uint16_t> crcs;
+    bool unsupported;
+} data_crcs;
 
 static int drive_selector(int head) {
-    return (head << 2) | args.drive;
+    // Drives 4-7 are on the second controller.
+    return (head << 2) | (args.drive & 3);
 }
 
 // Apply a mode specification to a floppy_raw_cmd -- which must contain only
@@ -88,7 +163,7 @@ static void fd_recalibrate(struct floppy_raw_cmd& cmd) {
     cmd.cmd_count = 2;
     cmd.flags = FD_RAW_INTR;
 
-    if (ioctl(dev_fd, FDRAWCMD, &cmd) < 0) {
+    if (fdc.raw_cmd(fdc, cmd) < 0) {
         die_errno("FD_RECALIBRATE failed");
     }
 }
@@ -113,7 +188,7 @@ static bool fd_readid(const track_t& track, struct floppy_raw_cmd& cmd) {
     cmd.track = track.phys_cyl * args.cyl_scale;
     apply_data_mode(track.data_mode, cmd);
 
-    if (ioctl(dev_fd, FDRAWCMD, &cmd) < 0) {
+    if (fdc.raw_cmd(fdc, cmd) < 0) {
         die_errno("FD_READID failed");
     }
     if (cmd.reply_count < 7) {
@@ -124,10 +199,38 @@ static bool fd_readid(const track_t& track, struct floppy_raw_cmd& cmd) {
     return ((cmd.reply[0] >> 6) & 3) == 0;
 }
 
+// Note where the head is after a read on track that stopped at the sector
+// with logical ID log_sec (or at the index hole if log_sec is -1).
+static void set_head_pos(const track_t& track, int log_sec) {
+    head_pos.track = NULL;
+    if (log_sec == -1) {
+        head_pos.track = &track;
+        head_pos.next_sec = 0;
+        return;
+    }
+    for (int i = 0; i < track.num_sectors; i++) {
+        if (track.sectors[i].log_sector == log_sec) {
+            head_pos.track = &track;
+            head_pos.next_sec = (i + 1) % track.num_sectors;
+            return;
+        }
+    }
+}
+
+// Return the number of sectors on track that go past the head while the
+// next command is being issued.
+static int turnaround_sectors(const track_t& track) {
+    const double sector_time = fdc.rev_time / track.num_sectors;
+    return std::min((int) ceil(turnaround_time / sector_time), track.num_sectors - 1);
+}
+
 // See: https://web.archive.org/web/20140620002630/http://cpctech.cpc-live.com/docs/upd765a/necfdc.htm
 
 // Read data from sectors with consecutive logical sector IDs.
-// The sector_t given is for the first sector to be read.
+// The sector_t given is for the first sector to be read, and eot is the
+// logical ID of the last one (or 0xFF to stop when buf is full). If
+// multi_track is set, the controller carries on from sector 1 on the other
+// side after eot.
 //
 // Return true if all data was read. Upon return:
 // cmd.reply[0]--[2] are ST0-ST2
@@ -135,29 +238,35 @@ static bool fd_readid(const track_t& track, struct floppy_raw_cmd& cmd) {
 // cmd.reply[4] is logical head
 // cmd.reply[5] is logical sector
 // (128 << cmd.reply[6]) is sector size
-static bool fd_read(const track_t& track, const sector_t& sector,
+// If with_crc is true, the sector is read as if it were twice the size, so
+// the CRC and gap after its data come back too.
+static bool fd_read(const track_t& track, const sector_t& sector, int eot,
+                    bool multi_track, bool with_crc,
                     unsigned char *buf, size_t buf_size,
                     struct floppy_raw_cmd& cmd) {
     memset(&cmd, 0, sizeof(cmd));
 
-    // 0x06 is READ DATA.
-    // (0x80 would be MT - span multiple tracks.)
-    // (0x20 would be SK - skip deleted data.)
-    cmd.cmd[0] = 0x06;
+    // 0x06 is READ DATA; 0x0C is READ DELETED DATA, which we use for
+    // sectors we know are deleted. Either will read the other kind of
+    // sector too, but stops after it and sets ST2_CM.
+    // 0x80 is MT - span multiple tracks.
+    // (0x20 would be SK - skip the other kind of sector.)
+    cmd.cmd[0] = (sector.deleted ? 0x0C : 0x06) | (multi_track ? 0x80 : 0);
     cmd.cmd[1] = drive_selector(track.phys_head);
     cmd.cmd[2] = sector.log_cyl;
     cmd.cmd[3] = sector.log_head;
     cmd.cmd[4] = sector.log_sector;
-    cmd.cmd[5] = track.sector_size_code;
+    const int size_code = track.sector_size_code + (with_crc ? 1 : 0);
+    cmd.cmd[5] = size_code;
     // End of track sector number.
-    cmd.cmd[6] = 0xFF;
+    cmd.cmd[6] = eot;
     // Intersector gap. There's a complex table of these for various formats in
     // the M1543C datasheet; the fdutils manual says it doesn't make any
     // difference for read. FIXME: hmm.
     cmd.cmd[7] = 0x1B;
     // Bytes in sector -- but only if size code is 0, else it should be 0xFF.
-    if (track.sector_size_code == 0) {
-        cmd.cmd[8] = sector_bytes(track.sector_size_code);
+    if (size_code == 0) {
+        cmd.cmd[8] = sector_bytes(size_code);
     } else {
         cmd.cmd[8] = 0xFF;
     }
@@ -168,15 +277,28 @@ static bool fd_read(const track_t& track, const sector_t& sector,
     cmd.length = buf_size;
     apply_data_mode(track.data_mode, cmd);
 
-    if (ioctl(dev_fd, FDRAWCMD, &cmd) < 0) {
+    if (fdc.raw_cmd(fdc, cmd) < 0) {
         die_errno("FD_READID failed");
     }
     if (cmd.reply_count < 7) {
         die("FD_READID returned short reply");
     }
 
-    // If we're reading multiple sectors but hit a deleted sector, then the
-    // read will have stopped there -- fail.
+    if ((cmd.reply[1] & ST1_ND) != 0
+        || ((cmd.reply[1] & ST1_MAM) != 0 && (cmd.reply[2] & ST2_MAM) == 0)) {
+        // The controller didn't find the sector's ID, and gave up at the
+        // index.
+        set_head_pos(track, -1);
+    } else if (((cmd.reply[0] >> 6) & 3) == 0) {
+        // The reply has the sector after the last one read.
+        set_head_pos(track, cmd.reply[5] - 1);
+    } else {
+        // The reply has the sector it stopped at.
+        set_head_pos(track, cmd.reply[5]);
+    }
+
+    // If we're reading multiple sectors but hit the other kind of sector,
+    // then the read will have stopped there -- fail.
     if (buf_size > sector_bytes(track.sector_size_code)
         && (cmd.reply[2] & 0x40) != 0) {
         return false;
@@ -200,15 +322,10 @@ static bool track_readid(track_t& track) {
         }
     } while (args.ignore_sector == cmd.reply[5]);
 
-    sector_t& sector = track.sectors[track.num_sectors];
-    assert_free_sector(sector);
-    sector.log_cyl = cmd.reply[3];
-    sector.log_head = cmd.reply[4];
-    sector.log_sector = cmd.reply[5];
     assert(cmd.reply[6] != UCHAR_MAX);
 
     if (track.sector_size_code == UCHAR_MAX) {
-        //printf("Got new sector_size_code %d\n", cmd.reply[6]);
+        //fprintf(status_out, "Got new sector_size_code %d\n", cmd.reply[6]);
         track.sector_size_code = cmd.reply[6];
     } else if (track.sector_size_code != cmd.reply[6]) {
         // Apparently this can legitimately occur on original floppies that have incorporated bizarre copy-protection. The game "QIX" does this, for example.
@@ -218,16 +335,91 @@ static bool track_readid(track_t& track) {
         return false; // This sector will be flagged SECTOR_MISSING, and dumpfloppy will ultimately return non-zero on the command line.
     }
 
-    track.num_sectors++;
+    resize_track(track, track.num_sectors + 1);
+    sector_t& sector = track.sectors[track.num_sectors - 1];
+    assert_free_sector(sector);
+    sector.log_cyl = cmd.reply[3];
+    sector.log_head = cmd.reply[4];
+    sector.log_sector = cmd.reply[5];
     return true;
 }
 
-// Identify the data mode and sector layout of a track.
-static bool probe_track(track_t& track) {
+// Learn from a track whose layout is known: it's the best guess for the
+// tracks near it on the same head, and if it was probed, comparing it with
+// the last track probed on that head shows how the sectors are skewed from
+// one cylinder to the next.
+static void learn_geometry(const track_t& track) {
+    const int head = track.phys_head;
+    const track_t *probed = geometry.probed[head];
+    geometry.known[head] = &track;
+    if (track.status != TRACK_PROBED) return;
+    geometry.probed[head] = &track;
+
+    const int n = track.num_sectors;
+    if (probed == NULL || probed == &track || probed->num_sectors != n) return;
+    const int cyl_diff = track.phys_cyl - probed->phys_cyl;
+    for (int skew = 0; skew < n; skew++) {
+        const int shift = ((skew * cyl_diff) % n + n) % n;
+        bool match = true;
+        for (int i = 0; i < n && match; i++) {
+            match = track.sectors[i].log_sector == probed->sectors[(i + shift) % n].log_sector;
+        }
+        if (match) {
+            geometry.skew = skew;
+            return;
+        }
+    }
+}
+
+// Return whether probe_track should try data mode a before mode b.
+static bool probe_mode_before(int a, int b) {
+    if ((a == probe_hint.good) != (b == probe_hint.good)) {
+        return a == probe_hint.good;
+    }
+    if (probe_hint.good_count[a] != probe_hint.good_count[b]) {
+        return probe_hint.good_count[a] > probe_hint.good_count[b];
+    }
+    return (probe_hint.failed & (1 << a)) == 0 && (probe_hint.failed & (1 << b)) != 0;
+}
+
+// Start probe_hint and geometry off with the tracks in a disk image we're
+// retrying.
+static void learn_from_image(disk_t& disk) {
+    for (int cyl = 0; cyl < disk.num_phys_cyls; cyl++) {
+        for (int head = 0; head < disk.num_phys_heads; head++) {
+            const track_t& track = disk_track(disk, cyl, head);
+            if (track.status == TRACK_UNKNOWN || track.data_mode == NULL) continue;
+            probe_hint.good_count[track.data_mode - DATA_MODES]++;
+            learn_geometry(track);
+        }
+    }
+    for (int i = 0; DATA_MODES[i].name != NULL; i++) {
+        if (probe_hint.good_count[i] > 0
+            && (probe_hint.good == -1 || probe_hint.good_count[i] > probe_hint.good_count[probe_hint.good])) {
+            probe_hint.good = i;
+        }
+    }
+}
+
+// Identify the data mode and sector layout of a track. If a readid in the
+// DATA_MODES entry synced_mode has just failed on the track (leaving the head
+// at the index hole), pass its index; otherwise pass -1.
+static bool probe_track(track_t& track, int synced_mode) {
     assert(track.status == TRACK_UNKNOWN);
 
-    printf("Probe %2d.%d:", track.phys_cyl, track.phys_head);
-    fflush(stdout);
+    fprintf(status_out, "Probe %2d.%d:", track.phys_cyl, track.phys_head);
+    fflush(status_out);
+
+    // Try the mode that worked last time first, then modes in order of how
+    // many tracks they've worked on, so the most likely modes go before
+    // ones that have never worked. Within that, modes that failed recently
+    // go last.
+    int order[8 * sizeof(probe_hint.failed)];
+    int num_modes = 0;
+    for (int i = 0; DATA_MODES[i].name != NULL; i++) {
+        order[num_modes++] = i;
+    }
+    std::stable_sort(order, order + num_modes, probe_mode_before);
 
     // We want to make sure that we start reading sector IDs from the index
     // hole. However, there isn't really a good way of finding out where the
@@ -238,121 +430,384 @@ static bool probe_track(track_t& track) {
     // before we have a successful one -- that way, the successful one will
     // definitely be at the start of the track!
     //
-    // The first readid we'll do in the loop below will be with DATA_MODES[0],
-    // so do a different one to ensure that at least one of them will fail.
-    track.data_mode = &DATA_MODES[1];
-    track_readid(track);
+    // The first readid we'll do in the loop below will be with order[0],
+    // so do a different one to ensure that at least one of them will fail --
+    // preferably one that failed last time, so it's the one that fails.
+    unsigned int failed = 0;
+    if (synced_mode != -1) {
+        failed |= 1 << synced_mode;
+    } else {
+        int sync_mode = order[1];
+        for (int i = 1; i < num_modes; i++) {
+            if ((probe_hint.failed & (1 << order[i])) != 0) {
+                sync_mode = order[i];
+                break;
+            }
+        }
+        track.data_mode = &DATA_MODES[sync_mode];
+        if (!track_readid(track)) {
+            failed |= 1 << sync_mode;
+        }
+    }
 
-    // Try all the possible data modes until we can read a sector ID.
-    track.num_sectors = 0;
+    // Try the possible data modes until we can read a sector ID.
+    resize_track(track, 0);
     track.sector_size_code = -1;
     for (int i = 0; ; i++) {
-        if (DATA_MODES[i].name == NULL) {
-            printf(" unknown data mode\n");
+        if (i == num_modes) {
+            fprintf(status_out, " unknown data mode\n");
             return false;
         }
+        if ((failed & (1 << order[i])) != 0) {
+            // It just failed as the sync.
+            continue;
+        }
 
-        track.data_mode = &DATA_MODES[i];
+        track.data_mode = &DATA_MODES[order[i]];
         if (track_readid(track)) {
             // This succeeded -- so we're at the start of the track
             // (see above).
+            probe_hint.good = order[i];
+            probe_hint.good_count[order[i]]++;
+            probe_hint.failed = (probe_hint.failed | failed) & ~(1 << order[i]);
             break;
         }
-    }
-
-    // Track how many times we've seen each logical sector.
-    int seen_secs[MAX_SECS];
-    for (int i = 0; i < MAX_SECS; i++) {
-        seen_secs[i] = 0;
+        failed |= 1 << order[i];
     }
 
     // FIXME: if the first sector wasn't the lowest-numbered one, this is
     // highly suspicious -- dump it and start again unless it does the same
     // thing a couple of times
 
-    // Read sector IDs until we've seen the complete sequence several times.
-    int count = 0;
-    while (true) {
-        if (!track_readid(track)) {
-            printf(" readid failed\n");
-            return false;
-        }
-        sector_t& sector = track.sectors[track.num_sectors-1];
-
-        seen_secs[sector.log_sector]++;
-
-        // We can be reasonably confident that we've got them all once we've
-        // seen each sector at least min_seen times.
-        const int min_seen = 3;
-        bool seen_all = true;
-        for (int i = 0; i < MAX_SECS; i++) {
-            if (seen_secs[i] != 0 && seen_secs[i] < min_seen) {
-                seen_all = false;
-            }
-        }
-        if (seen_all) break;
-
+    // Read sector IDs until the sequence has come round to the first sector
+    // again, and then repeated itself for a second revolution to confirm
+    // that we've not missed any. If we're missing sectors, this has a
+    // reasonable chance of spotting it. period is the length of the
+    // sequence, or 0 if we've not seen it repeat yet.
+    // FIXME: There should be an option to override this for *really* dodgy
+    // disks, and just assume the sectors are in order.
+    int period = 0;
+    while (period == 0 || track.num_sectors < 2 * period) {
         // Make sure we don't get stuck in this loop forever (although this is
         // highly unlikely).
         const int max_count = 100;
-        if (count > max_count) {
-            printf(" spent too long looking for sector IDs\n");
+        if (track.num_sectors > max_count) {
+            fprintf(status_out, " spent too long looking for sector IDs\n");
             return false;
         }
-    }
 
-    // Find where the first sector repeats, and cut the sequence off there.
-    int end_pos = 1;
-    while (!same_sector_addr(track.sectors[0], track.sectors[end_pos])) {
-        end_pos++;
-        if (end_pos == track.num_sectors) {
-            printf(" couldn't find repeat of first sector\n");
+        if (!track_readid(track)) {
+            fprintf(status_out, " readid failed\n");
             return false;
         }
-    }
-
-    // Check that the sequence repeated itself consistently after that.
-    // If we're missing sectors, this has a reasonable chance of spotting it.
-    // FIXME: There should be an option to override this for *really* dodgy
-    // disks, and just assume the sectors are in order.
-    for (int pos = end_pos; pos < track.num_sectors; pos++) {
-        if (!same_sector_addr(track.sectors[pos % end_pos], track.sectors[pos])) {
-            printf("  sector sequence did not repeat consistently\n");
-            return false;
+        const int pos = track.num_sectors - 1;
+
+        if (period != 0
+            && !same_sector_addr(track.sectors[pos - period], track.sectors[pos])) {
+            // That wasn't the sequence repeating after all, so find the next
+            // repeat of the first sector that's consistent with what we've
+            // read since.
+            int next = period + 1;
+            for (; next <= pos; next++) {
+                bool consistent = true;
+                for (int i = next; i <= pos && consistent; i++) {
+                    consistent = same_sector_addr(track.sectors[i - next], track.sectors[i]);
+                }
+                if (consistent) break;
+            }
+            period = next <= pos ? next : 0;
+        } else if (period == 0 && pos > 0
+                   && same_sector_addr(track.sectors[0], track.sectors[pos])) {
+            period = pos;
         }
     }
 
-    // Cut the sequence to length.
-    track.num_sectors = end_pos;
+    // Cut the sequence to length. The head's just after the last ID read.
+    const int end_pos = period;
+    const int num_read = track.num_sectors;
+    resize_track(track, end_pos);
+    head_pos.track = &track;
+    head_pos.next_sec = num_read % end_pos;
 
     // Show what we found.
-    printf(" %s %dx%d:",
+    fprintf(status_out, " %s %dx%zu:",
            track.data_mode->name,
            track.num_sectors, sector_bytes(track.sector_size_code));
     for (int i = 0; i < track.num_sectors; i++) {
-        printf(" %d", track.sectors[i].log_sector);
+        fprintf(status_out, " %d", track.sectors[i].log_sector);
     }
-    printf("\n");
+    fprintf(status_out, "\n");
 
     track.status = TRACK_PROBED;
+    learn_geometry(track);
     return true;
 }
 
-// Try to read any sectors in a track that haven't already been read.
-// Returns true if everything has been read.
+// Guess the layout of an unknown track from the geometry we've learned.
+static void predict_layout(track_t& track) {
+    const track_t *known = geometry.known[track.phys_head];
+    if (known == NULL) return;
+
+    copy_track_layout(*known, track);
+
+    // Rotate the sectors to allow for any skew between cylinders.
+    const int n = track.num_sectors;
+    const int cyl_diff = track.phys_cyl - known->phys_cyl;
+    const int shift = geometry.skew * cyl_diff;
+    for (int i = 0; i < n; i++) {
+        const sector_t& src_sec = known->sectors[((i + shift) % n + n) % n];
+        sector_t& dest_sec = track.sectors[i];
+        dest_sec.log_cyl = src_sec.log_cyl + cyl_diff;
+        dest_sec.log_head = src_sec.log_head;
+        dest_sec.log_sector = src_sec.log_sector;
+    }
+}
+
+// Check a guessed layout by reading one sector ID from the track. If it
+// doesn't match, probe the track instead.
+static void check_guessed_layout(track_t& track) {
+    assert(track.status == TRACK_GUESSED);
+
+    struct floppy_raw_cmd cmd;
+    bool readid_ok;
+    do {
+        readid_ok = fd_readid(track, cmd);
+    } while (readid_ok && args.ignore_sector == cmd.reply[5]);
+
+    if (readid_ok && cmd.reply[6] == track.sector_size_code) {
+        for (int i = 0; i < track.num_sectors; i++) {
+            const sector_t& sector = track.sectors[i];
+            if (sector.log_cyl == cmd.reply[3] && sector.log_head == cmd.reply[4]
+                && sector.log_sector == cmd.reply[5]) {
+                // It's right as far as we can tell -- and now we know where
+                // the head is.
+                set_head_pos(track, cmd.reply[5]);
+                return;
+            }
+        }
+    }
+
+    // Wrong. If the readid failed, it's left the head at the index hole, so
+    // the probe needn't find it again.
+    const int mode = track.data_mode - DATA_MODES;
+    init_track(track.phys_cyl, track.phys_head, track);
+    if (probe_track(track, readid_ok ? -1 : mode)) {
+        journal_layout(journal, track);
+    }
+}
+
+// After a multi-sector read of count sectors from first has failed, return
+// how many of them were read successfully before it stopped, or -1 if we
+// can't tell. The reply has the sector it stopped at, and we check that
+// against the amount of data transferred.
+static int sectors_before_failure(const sector_t& first, int count,
+                                  size_t sector_size,
+                                  const struct floppy_raw_cmd& cmd) {
+    int stopped;
+    if (((cmd.reply[0] >> 6) & 3) == 1) {
+        stopped = cmd.reply[5] - first.log_sector;
+    } else if ((cmd.reply[2] & ST2_CM) != 0) {
+        // It read the other kind of sector and stopped after it, ending
+        // normally -- so the reply is for the sector after that.
+        stopped = cmd.reply[5] - 1 - first.log_sector;
+    } else {
+        return -1;
+    }
+    if (cmd.reply[3] != first.log_cyl || cmd.reply[4] != first.log_head) {
+        return -1;
+    }
+    if (stopped == 0 && (cmd.reply[1] & ST1_ND) != 0) {
+        // It couldn't find the first sector at all -- which probably means
+        // the layout's wrong, so don't go on trying runs.
+        return -1;
+    }
+    if (stopped < 0 || stopped >= count) {
+        return -1;
+    }
+    const long transferred = sector_size * count - cmd.length;
+    return std::min(stopped, (int) (transferred / sector_size));
+}
+
+// Return whether the sector a read stopped at was a deleted sector.
+static bool read_was_deleted(const struct floppy_raw_cmd& cmd) {
+    const bool read_deleted = (cmd.cmd[0] & 0x1F) == 0x0C;
+    // ST2_CM (0x40) is Control Mark -- the other kind of sector was read.
+    return read_deleted != ((cmd.reply[2] & ST2_CM) != 0);
+}
+
+// Record a read of a single sector, given the controller's reply and the
+// data it transferred. Return the character to show for the sector.
+static char record_sector_read(track_t& track, int phys_sec, bool read_ok,
+                               const uint8_t *data,
+                               const struct floppy_raw_cmd& cmd) {
+    sector_t& sector = track.sectors[phys_sec];
+    const int sector_size = sector_bytes(track.sector_size_code);
+
+    if (read_ok) {
+        // Success!
+        const bool deleted = read_was_deleted(cmd);
+        const bool new_data = record_good_read(sector, data, sector_size, deleted, false);
+        journal_read(journal, track, phys_sec, JOURNAL_GOOD | (deleted ? JOURNAL_DELETED : 0),
+                     data, sector_size, new_data);
+        return deleted ? 'x' : '+';
+    }
+
+    if ((cmd.reply[2] & ST2_CRC) == 0) {
+        return '-'; // No data.
+    }
+
+    // ST2_CRC (0x20) "CRC error in data field". Better than nothing, but we'll want to try again.
+    assert(!(cmd.reply[2] & (ST2_WC|ST2_SEH|ST2_SNS|ST2_BC|ST2_MAM)));
+    assert(cmd.reply[1] == ST1_CRC);
+
+    const bool deleted = read_was_deleted(cmd);
+    const bool bad_data_new_read = record_bad_read(sector, data, sector_size, deleted);
+    journal_read(journal, track, phys_sec, deleted ? JOURNAL_DELETED : 0,
+                 data, sector_size, bad_data_new_read);
+    return bad_data_new_read ? '?' : '@';
+}
+
+// A sector's ID rather than its position in the track identifies it, since
+// the track's layout may be probed again and come out differently.
+static uint64_t data_crc_key(const track_t& track, int phys_sec) {
+    const sector_t& sector = track.sectors[phys_sec];
+    uint64_t key = (track.phys_cyl * 2) + track.phys_head;
+    key = (key << 8) | sector.log_cyl;
+    key = (key << 8) | sector.log_head;
+    key = (key << 8) | sector.log_sector;
+    return (key << 8) | track.sector_size_code;
+}
+
+// Read a single sector into buf, which must have room for twice its data.
+// If it's been read with CRC errors more than once before, and we don't
+// know the CRC written on the disk for it yet, it's read along with the CRC
+// after it -- which the controller always reports as a CRC error, since it
+// checks the wrong bytes, so return whether the data matches the CRC
+// instead. (The read runs over the next sector's ID, so that has to wait
+// for another revolution -- it's not worth it for a one-off error, or if
+// the versions read are too different to correct.)
+static bool read_sector(track_t& track, int phys_sec, uint8_t *buf,
+                        struct floppy_raw_cmd& cmd) {
+    const sector_t& sector = track.sectors[phys_sec];
+    const long sector_size = sector_bytes(track.sector_size_code);
+    const uint64_t key = data_crc_key(track, phys_sec);
+    uint64_t reads = 0;
+    for (size_t i = 0; i < sector.datas.size(); i++) {
+        reads += sector.datas[i].count;
+    }
+    if (sector.status != SECTOR_BAD || reads < 2 || !sector_correctable(sector)
+        || data_crcs.unsupported
+        || track.sector_size_code >= 7 || data_crcs.crcs.count(key) != 0) {
+        return fd_read(track, sector, 0xFF, false, false, buf, sector_size, cmd);
+    }
+
+    fd_read(track, sector, 0xFF, false, true, buf, sector_size * 2, cmd);
+    if (head_pos.track == &track) {
+        head_pos.next_sec = (head_pos.next_sec + 1) % track.num_sectors;
+    }
+    if ((cmd.reply[1] & ST1_ND) != 0) {
+        // If it can find the sector when it's the right size, the
+        // controller must be checking the size in the sector's ID.
+        const bool read_ok = fd_read(track, sector, 0xFF, false, false, buf, sector_size, cmd);
+        if ((cmd.reply[1] & ST1_ND) == 0) {
+            data_crcs.unsupported = true;
+        }
+        return read_ok;
+    }
+    if ((cmd.reply[2] & ST2_CRC) == 0 || sector_size * 2 - cmd.length < sector_size + 2) {
+        return false;
+    }
+
+    const uint16_t crc = (buf[sector_size] << 8) | buf[sector_size + 1];
+    data_crcs.crcs[key] = crc;
+    return data_field_crc(track.data_mode->is_fm, read_was_deleted(cmd), buf, sector_size) == crc;
+}
+
+// Try to correct a sector that's just been read with a new version of its
+// data, using the CRC written on the disk after it, if we know that. Return
+// whether it's been corrected.
+static bool correct_sector(track_t& track, int phys_sec) {
+    sector_t& sector = track.sectors[phys_sec];
+    const int sector_size = sector_bytes(track.sector_size_code);
+    std::map<uint64_t, uint16_t>::const_iterator it = data_crcs.crcs.find(data_crc_key(track, phys_sec));
+    if (it == data_crcs.crcs.end()) return false;
+
+    data_t data;
+    if (!correct_sector_data(sector, track.data_mode->is_fm, it->second, data)) {
+        return false;
+    }
+    record_good_read(sector, data.data(), sector_size, sector.deleted, true);
+    journal_read(journal, track, phys_sec, JOURNAL_GOOD | JOURNAL_REPLACE | (sector.deleted ? JOURNAL_DELETED : 0),
+                 data.data(), sector_size, true);
+    return true;
+}
+
+// Return whether a bad sector has been read enough times that reading it
+// again is unlikely to tell us anything new: one version of its data has
+// come back confidence times more than any other.
+static bool sector_settled(const sector_t& sector) {
+    if (args.confidence <= 0 || sector.status != SECTOR_BAD) return false;
+    uint32_t best = 0, second = 0;
+    for (size_t i = 0; i < sector.datas.size(); i++) {
+        const uint32_t count = sector.datas[i].count;
+        if (count > best) {
+            second = best;
+            best = count;
+        } else if (count > second) {
+            second = count;
+        }
+    }
+    return best - second >= (uint32_t) args.confidence;
+}
+
+// Count the sectors in a track that are still worth reading, and the
+// versions of data we've seen for them.
+static void unsettled_sectors(const track_t& track, int *unsettled, int *variants) {
+    *unsettled = 0;
+    *variants = 0;
+    for (int i = 0; i < track.num_sectors; i++) {
+        const sector_t& sector = track.sectors[i];
+        if (sector.status != SECTOR_GOOD && !sector_settled(sector)) {
+            (*unsettled)++;
+            *variants += sector.datas.size();
+        }
+    }
+}
+
+// Estimate how many more of a track's sectors another pass of read_track
+// would read successfully. A sector that's failed n times is taken to read
+// with probability 1/(n+2) (Laplace's rule of succession); for sectors
+// that have never returned any data, n is the number of passes.
+static double retry_gain(const track_t& track, int passes) {
+    double gain = 0.0;
+    for (int i = 0; i < track.num_sectors; i++) {
+        const sector_t& sector = track.sectors[i];
+        if (sector.status == SECTOR_GOOD || sector_settled(sector)) continue;
+        long reads = 0;
+        for (size_t j = 0; j < sector.datas.size(); j++) {
+            reads += sector.datas[j].count;
+        }
+        gain += 1.0 / (std::max(reads, (long) passes) + 2);
+    }
+    return gain;
+}
+
+// Try to read any sectors in a track that haven't already been read (or
+// that have settled, as above). Returns true if everything has been read.
 static bool read_track(track_t& track, const bool retrying) {
     struct floppy_raw_cmd cmd;
 
     if (track.status == TRACK_UNKNOWN) {
-        if (!probe_track(track)) {
+        if (!probe_track(track, -1)) {
             return false;
         }
+        journal_layout(journal, track);
     }
 
     if (retrying) {
         bool have_everything = true;
         for (int i = 0; i < track.num_sectors; i++) {
-            if (track.sectors[i].status != SECTOR_GOOD) {
+            if (track.sectors[i].status != SECTOR_GOOD && !sector_settled(track.sectors[i])) {
                 have_everything = false;
                 break;
             }
@@ -361,118 +816,275 @@ static bool read_track(track_t& track, const bool retrying) {
             return true; // Nothing else to do for this track. Avoid even printing the "Read..." line.
         }
     }
-    printf("Read  %2d.%d:", track.phys_cyl, track.phys_head);
-    fflush(stdout);
-
-    const sector_t* lowest_sector;
-    const bool contiguous = retrying || track_scan_sectors(track, &lowest_sector);
+    fprintf(status_out, "Read  %2d.%d:", track.phys_cyl, track.phys_head);
+    fflush(status_out);
 
     const int sector_size = sector_bytes(track.sector_size_code);
-    const int track_size = sector_size * track.num_sectors;
-    unsigned char track_data[track_size];
-    bool read_whole_track = false;
 
-    // FIXME: Read with the flag set that means deleted sectors won't be
-    // ignored (since we can't tell from readid whether the sectors were
-    // regular or deleted).
     // FIXME: Describe read errors, with the phys/log context.
 
-    if (contiguous && !retrying) {
-        // Try reading the whole track to start with.
-        // If this works, it's a lot faster than reading sector-by-sector.
-        // The resulting data will be ordered by *logical* ID.
-        if (fd_read(track, *lowest_sector, track_data, track_size, cmd)) {
-            read_whole_track = true;
-        }
+    // Sectors with consecutive logical IDs can be read with one command,
+    // which is a lot faster than reading sector-by-sector. To start with,
+    // that's each run of IDs on the track; on later passes, it's each run
+    // of sectors that haven't been read yet.
+    //
+    // We can't tell from readid whether a sector is regular or deleted, so
+    // runs are read with READ DATA until we know better. A deleted sector
+    // stops the read just after it (and is read fine); after that, runs of
+    // deleted sectors are read with READ DELETED DATA.
+
+    // The physical sector with each logical ID, or -1 if there isn't
+    // exactly one.
+    int phys_of[256];
+    for (int id = 0; id < 256; id++) {
+        phys_of[id] = -1;
     }
+    bool seen_id[256] = {false};
+    for (int i = 0; i < track.num_sectors; i++) {
+        const int id = track.sectors[i].log_sector;
+        phys_of[id] = seen_id[id] ? -1 : i;
+        seen_id[id] = true;
+    }
+    unsigned char run_data[sector_size * track.num_sectors];
 
-    // Get sectors in physical order.
-    bool all_ok = true;
+    // What to show for each sector, in physical order.
+    std::vector<std::string> shown(track.num_sectors, "    ");
+    bool want[MAX_SECS];
+    // Sectors to read on their own, because a run they were in failed.
+    bool single[MAX_SECS];
     for (int i = 0; i < track.num_sectors; i++) {
-        sector_t& sector = track.sectors[i];
+        want[i] = track.sectors[i].status != SECTOR_GOOD && !sector_settled(track.sectors[i]);
+        single[i] = false;
+    }
 
-        if (sector.status == SECTOR_GOOD) {
-            // Already got this one.
-            printf("    ");
-            continue;
+    // Get sectors in the order they come round to the head.
+    bool all_ok = true;
+    while (true) {
+        int first = 0;
+        if (head_pos.track == &track && head_pos.next_sec < track.num_sectors) {
+            first = head_pos.next_sec + turnaround_sectors(track);
         }
+        int i = -1;
+        int wait = 0; // Sectors the read will wait for before its own
+        for (int j = 0; j < track.num_sectors; j++) {
+            const int pos = (first + j) % track.num_sectors;
+            if (want[pos]) {
+                i = pos;
+                wait = (i - head_pos.next_sec + track.num_sectors) % track.num_sectors;
+                break;
+            }
+        }
+        if (i == -1) break;
+        const bool pos_known = (head_pos.track == &track);
 
-        printf("%3d", sector.log_sector);
-        fflush(stdout);
-
-        if (read_whole_track) {
-            // We read this sector as part of the whole track. Success!
-            const int rel_sec = sector.log_sector - lowest_sector->log_sector;
-
-            sector.status = SECTOR_GOOD;
-
-            // If this was previously part of a bad read, but on a subsequent track attempt we
-            // read the whole track, then we start over with an empty sector and our one good read.
-            sector.datas.clear();
-
-            sector.datas[data_t(track_data + (sector_size * rel_sec), sector_size)] = 1; // 1 meaning we've seen this data 1 time now.
-            sector.deleted = false;
+        sector_t& sector = track.sectors[i];
 
-            printf("*");
-            continue;
+        // See how many of the following logical IDs we can read along with
+        // this one.
+        int run = 1;
+        while (!single[i] && sector.log_sector + run < 256) {
+            const int j = phys_of[sector.log_sector + run];
+            if (j == -1 || !want[j] || single[j]
+                || track.sectors[j].log_cyl != sector.log_cyl
+                || track.sectors[j].log_head != sector.log_head
+                || track.sectors[j].deleted != sector.deleted) {
+                break;
+            }
+            run++;
         }
 
-        uint8_t data_buf[sector_size];
-        bool have_data = true;
-        bool bad_data_new_read = true;
+        if (run > 1) {
+            const bool run_ok = fd_read(track, sector, sector.log_sector + run - 1, false, false,
+                                        run_data, sector_size * run, cmd);
+            const int stopped = run_ok ? run : sectors_before_failure(sector, run, sector_size, cmd);
+            const int num_good = std::max(stopped, 0);
+
+            // The data is ordered by *logical* ID.
+            for (int k = 0; k < num_good; k++) {
+                const int j = phys_of[sector.log_sector + k];
+                const uint8_t *data = run_data + (sector_size * k);
+
+                // If this was previously part of a bad read, but on a subsequent attempt we
+                // read it as part of a run, then we start over with an empty sector and our one good read.
+                record_good_read(track.sectors[j], data, sector_size, sector.deleted, true);
+                journal_read(journal, track, j, JOURNAL_GOOD | JOURNAL_REPLACE | (sector.deleted ? JOURNAL_DELETED : 0),
+                             data, sector_size, true);
+
+                shown[j] = str_sprintf("%3d%c", track.sectors[j].log_sector, sector.deleted ? 'x' : '*');
+                want[j] = false;
+            }
 
-        // Read a single sector.
-        if (!fd_read(track, sector, data_buf, sector_size, cmd)) {
-            all_ok = false;
-            if ((cmd.reply[2] & ST2_CRC) != 0) {
-                // ST2_CRC (0x20) "CRC error in data field". Better than nothing, but we'll want to try again.
-                sector.status = SECTOR_BAD;
-                assert(!(cmd.reply[2] & (ST2_WC|ST2_SEH|ST2_SNS|ST2_BC|ST2_MAM)));
-                assert(cmd.reply[1] == ST1_CRC);
-
-                data_t data_str = data_t(data_buf, sector_size);
-                data_map_t::iterator iter = sector.datas.find(data_str);
-                if (iter == sector.datas.end()) {
-                    sector.datas.insert(data_map_t::value_type(data_str, 1)); // 1 meaning we've seen this data 1 time now.
+            if (stopped == run) {
+                // Success!
+            } else if (stopped != -1) {
+                // The sectors after the one the controller stopped at can
+                // still be read as a run.
+                const int j = phys_of[sector.log_sector + stopped];
+                const long transferred = sector_size * run - cmd.length;
+                const uint8_t *data = run_data + (sector_size * stopped);
+                if (transferred < sector_size * (stopped + 1)) {
+                    single[j] = true;
+                } else if (((cmd.reply[0] >> 6) & 3) == 0) {
+                    // It stopped after reading a sector with the other kind
+                    // of data mark -- which is a perfectly good read.
+                    shown[j] = str_sprintf("%3d%c", track.sectors[j].log_sector,
+                                           record_sector_read(track, j, true, data, cmd));
+                    want[j] = false;
                 } else {
-                    if (iter->second != UINT32_MAX) {
-                        iter->second++;
+                    // It needs reading on its own -- but if it stopped
+                    // because of a CRC error, keep the data we got.
+                    if ((cmd.reply[2] & ST2_CRC) != 0) {
+                        record_sector_read(track, j, false, data, cmd);
                     }
-                    bad_data_new_read = false; // Got prior sector byte read again.
+                    single[j] = true;
                 }
             } else {
-                have_data = false; // No data.
-            }
-        } else {
-            // Success!
-            sector.status = SECTOR_GOOD;
-            // Normally the '1' means we've seen this data 1 time now. But if we've ever seen anything else, this successful
-            // read should trump them all with the highest possible "seen count."
-            sector.datas.insert(data_map_t::value_type(data_t(data_buf, sector_size), sector.datas.empty() ? 1 : UINT32_MAX));
-        }
-
-        if (have_data) {
-            // ST2_CM (0x40) is Control Mark -- a deleted sector was read.
-            sector.deleted = (cmd.reply[2] & ST2_CM) != 0;
-
-            if (sector.status == SECTOR_BAD) {
-                assert(!all_ok);
-                printf(bad_data_new_read ? "?" : "@");
-            } else if (sector.deleted) {
-                printf("x");
-            } else {
-                printf("+");
+                // We don't know where it stopped. Read the sectors one at
+                // a time to find out which failed.
+                for (int k = 0; k < run; k++) {
+                    single[phys_of[sector.log_sector + k]] = true;
+                }
             }
-        } else {
-            printf("-");
+            continue;
+        }
+        want[i] = false;
+
+        // Read a single sector.
+        uint8_t data_buf[sector_size * 2];
+        const double start_time = fdc.busy_time;
+        const bool read_ok = read_sector(track, i, data_buf, cmd);
+        if (!read_ok) {
+            all_ok = false;
         }
-        fflush(stdout);
+        char status = record_sector_read(track, i, read_ok, data_buf, cmd);
+
+        // If the sector was found, but it took a good deal longer than it
+        // should have to come round, then we just missed it and had to wait
+        // another revolution -- so leave a bigger gap next time.
+        const double sector_time = fdc.rev_time / track.num_sectors;
+        if (pos_known && status != '-'
+            && fdc.busy_time - start_time > (wait + 1) * sector_time + fdc.rev_time / 2) {
+            turnaround_time = std::max(turnaround_time, (wait + 0.5) * sector_time);
+        }
+
+        // A new version of the data might be close enough to correct.
+        if (status == '?' && correct_sector(track, i)) {
+            status = '!';
+        }
+
+        shown[i] = str_sprintf("%3d%c", sector.log_sector, status);
     }
 
-    printf("\n");
+    for (int i = 0; i < track.num_sectors; i++) {
+        fprintf(status_out, "%s", shown[i].c_str());
+    }
+    fprintf(status_out, "\n");
     return all_ok;
 }
 
+// Return whether every sector in a track has been found, even if only with
+// a CRC error -- which shows that a guessed layout is right, so the track
+// needn't be probed again.
+static bool all_sectors_found(const track_t& track) {
+    for (int i = 0; i < track.num_sectors; i++) {
+        if (track.sectors[i].status == SECTOR_MISSING) return false;
+    }
+    return true;
+}
+
+// Find the sector with logical IDs 1 to num_sectors in a track, in order,
+// if it has exactly those, all with the same cylinder and head and none
+// known to be deleted.
+static bool find_numbered_sectors(const track_t& track, int log_head,
+                                  int *phys_of) {
+    for (int i = 0; i < track.num_sectors; i++) {
+        phys_of[i] = -1;
+    }
+    for (int i = 0; i < track.num_sectors; i++) {
+        const sector_t& sector = track.sectors[i];
+        const int id = sector.log_sector;
+        if (id < 1 || id > track.num_sectors || phys_of[id - 1] != -1) return false;
+        if (sector.log_cyl != track.sectors[0].log_cyl) return false;
+        if (sector.log_head != log_head || sector.deleted) return false;
+        if (sector.status == SECTOR_GOOD) return false;
+        phys_of[id - 1] = i;
+    }
+    return true;
+}
+
+// If both sides of a cylinder are laid out the way the controller expects
+// for a multi-track read -- sectors 1 to N on each side, with logical heads
+// 0 and 1 -- then read the whole cylinder with one command. Return true if
+// that worked, in which case both tracks have been read; otherwise they
+// need reading separately, although any sectors read before the one that
+// failed have been kept.
+static bool read_cylinder(track_t& track0, track_t& track1) {
+    if (track0.status == TRACK_UNKNOWN || track1.status == TRACK_UNKNOWN) return false;
+    if (track0.data_mode != track1.data_mode) return false;
+    if (track0.sector_size_code != track1.sector_size_code) return false;
+    if (track0.num_sectors != track1.num_sectors || track0.num_sectors == 0) return false;
+
+    const int num_sectors = track0.num_sectors;
+    int phys_of[2][MAX_SECS];
+    if (!find_numbered_sectors(track0, 0, phys_of[0])) return false;
+    if (!find_numbered_sectors(track1, 1, phys_of[1])) return false;
+    if (track0.sectors[0].log_cyl != track1.sectors[0].log_cyl) return false;
+
+    const int sector_size = sector_bytes(track0.sector_size_code);
+    unsigned char data[2 * num_sectors * sector_size];
+    struct floppy_raw_cmd cmd;
+    const bool ok = fd_read(track0, track0.sectors[phys_of[0][0]], num_sectors, true, false,
+                            data, sizeof(data), cmd);
+    // fd_read assumed it stayed on track0.
+    head_pos.track = NULL;
+
+    // The data is ordered by side, then by logical ID.
+    track_t *tracks[2] = { &track0, &track1 };
+    int num_good = 2 * num_sectors;
+    if (!ok) {
+        // Keep the sectors before the one it stopped at, if we can tell
+        // where that was.
+        const int side = cmd.reply[4];
+        num_good = 0;
+        if (((cmd.reply[0] >> 6) & 3) == 1 && (cmd.reply[2] & ST2_CM) == 0
+            && cmd.reply[3] == track0.sectors[0].log_cyl
+            && (side == 0 || side == 1)
+            && cmd.reply[5] >= 1 && cmd.reply[5] <= num_sectors) {
+            const long transferred = sizeof(data) - cmd.length;
+            num_good = std::min(side * num_sectors + cmd.reply[5] - 1,
+                                (int) (transferred / sector_size));
+            if ((cmd.reply[1] & ST1_ND) == 0) {
+                set_head_pos(*tracks[side], cmd.reply[5]);
+            }
+        }
+    }
+
+    for (int n = 0; n < num_good; n++) {
+        track_t& track = *tracks[n / num_sectors];
+        const int i = phys_of[n / num_sectors][n % num_sectors];
+        const uint8_t *sector_data = data + (sector_size * n);
+        record_good_read(track.sectors[i], sector_data, sector_size, false, true);
+        journal_read(journal, track, i, JOURNAL_GOOD|JOURNAL_REPLACE, sector_data, sector_size, true);
+    }
+    if (!ok) {
+        // The rest will be read track by track.
+        return false;
+    }
+
+    // Success!
+    for (int side = 0; side < 2; side++) {
+        const track_t& track = *tracks[side];
+        fprintf(status_out, "Read  %2d.%d:", track.phys_cyl, track.phys_head);
+        for (int i = 0; i < num_sectors; i++) {
+            fprintf(status_out, "%3d*", track.sectors[i].log_sector);
+        }
+        fprintf(status_out, "\n");
+    }
+    head_pos.track = &track1;
+    head_pos.next_sec = (phys_of[1][num_sectors - 1] + 1) % num_sectors;
+    return true;
+}
+
 static void probe_disk(disk_t& disk) {
     // Probe both sides of cylinder 2 to figure out the disk geometry.
     // (Cylinder 2 because we need a physical cylinder greater than 0 to figure
@@ -481,41 +1093,86 @@ static void probe_disk(disk_t& disk) {
 
     const int cyl = 2;
     for (int head = 0; head < disk.num_phys_heads; head++) {
-        probe_track(disk.tracks[cyl][head]);
+        probe_track(disk_track(disk, cyl, head), -1);
     }
 
-    track_t& side0 = disk.tracks[cyl][0];
-    sector_t& sec0 = side0.sectors[0];
-    track_t& side1 = disk.tracks[cyl][1];
-    sector_t& sec1 = side1.sectors[0];
+    // A track that couldn't be probed has no sectors, so compare against a
+    // blank sector instead.
+    sector_t blank;
+    init_sector(blank);
+
+    track_t& side0 = disk_track(disk, cyl, 0);
+    const sector_t& sec0 = side0.num_sectors > 0 ? side0.sectors[0] : blank;
+    track_t& side1 = disk_track(disk, cyl, 1);
+    const sector_t& sec1 = side1.num_sectors > 0 ? side1.sectors[0] : blank;
 
     if (side0.status == TRACK_UNKNOWN && side1.status == TRACK_UNKNOWN) {
         die("Cylinder 2 unreadable on either side");
     } else if (side1.status == TRACK_UNKNOWN) {
-        printf("Single-sided disk\n");
+        fprintf(status_out, "Single-sided disk\n");
         disk.num_phys_heads = 1;
     } else if (sec0.log_head == 0 && sec1.log_head == 0) {
-        printf("Double-sided disk with separate sides\n");
+        fprintf(status_out, "Double-sided disk with separate sides\n");
     } else {
-        printf("Double-sided disk\n");
+        fprintf(status_out, "Double-sided disk\n");
     }
 
     if (sec0.log_cyl * 2 == side0.phys_cyl) {
-        printf("Doublestepping required (40T disk in 80T drive)\n");
+        fprintf(status_out, "Doublestepping required (40T disk in 80T drive)\n");
         args.cyl_scale = 2;
+
+        // The tracks we've probed were at the wrong cylinders, so forget them.
+        for (int head = 0; head < disk.num_phys_heads; head++) {
+            init_track(cyl, head, disk_track(disk, cyl, head));
+            geometry.known[head] = geometry.probed[head] = NULL;
+        }
     } else if (sec0.log_cyl == side0.phys_cyl * 2) {
         die("Can't read this disk (80T disk in 40T drive)");
     } else if (sec0.log_cyl != side0.phys_cyl) {
-        printf("Mismatch between physical and logical cylinders\n");
+        fprintf(status_out, "Mismatch between physical and logical cylinders\n");
+    }
+
+    // Probe the next cylinder on one side too, to see whether the sectors
+    // are skewed from one cylinder to the next. (That's not worth doing if
+    // we're doublestepping, since we'd be probing between tracks.)
+    if (args.cyl_scale == 1 && disk.num_phys_cyls > cyl + 1) {
+        probe_track(disk_track(disk, cyl + 1, 0), -1);
     }
 }
 
-static int process_floppy(void) {
+// Write a whole disk to filename.in_progress, and rename it over filename.
+static void write_image(disk_t& disk, const char *filename, mode_t mode) {
+    const std::string filename_in_progress = str_sprintf("%s.in_progress", filename);
+    image_out.fd = open(filename_in_progress.c_str(), O_CREAT|O_TRUNC|O_WRONLY, mode);
+    if (image_out.fd == -1) {
+        die_errno("cannot open %s for writing", filename_in_progress.c_str());
+    }
+    image_out.filename = filename_in_progress;
+
+    std::vector<uint8_t> image_buf;
+    encode_imd_header(disk, image_buf);
+    write_all(image_out.fd, &image_buf[0], image_buf.size());
+    for (int cyl = 0; cyl < disk.num_phys_cyls; cyl++) {
+        for (int head = 0; head < disk.num_phys_heads; head++) {
+            write_imd_track_fd(disk_track(disk, cyl, head), image_out.fd, image_buf);
+        }
+    }
+    close(image_out.fd);
+    image_out.fd = -1;
+
+    if (rename(filename_in_progress.c_str(), filename) != 0) {
+        die_errno("rename \"%s\" to \"%s\" failed", filename_in_progress.c_str(), filename);
+    }
+    image_out.filename.clear();
+}
+
+static int dump_disk(disk_t& disk) {
     bool retrying = false;
-    disk_t disk;
     assert(args.image_filename != NULL);
 
     mode_t image_file_mode = S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH;
+    off_t image_size = 0;
+    const std::string journal_name = journal_filename(args.image_filename);
     // If the image exists already, load it, and continue from there.
     if (access(args.image_filename, F_OK) != -1) {
         if (!args.retry) {
@@ -526,14 +1183,29 @@ static int process_floppy(void) {
             die_errno("stat failed on %s", args.image_filename);
         }
         image_file_mode = mystat.st_mode;
-        FILE *f = fopen(args.image_filename, "rb");
-        if (f == NULL) {
-            die_errno("cannot open %s for reading", args.image_filename);
-        }
-        read_imd(f, disk);
-        fclose(f);
+        image_size = mystat.st_size;
+        map_imd(args.image_filename, disk);
         retrying = true;
-        fprintf(stdout, "Loaded prior image. Retrying failed reads...\n");
+
+        // Bring the disk up to date with the reads from earlier retries, and
+        // carry on appending to the same journal.
+        const uint64_t image_hash = hash_image_file(args.image_filename);
+        size_t journal_length;
+        switch (replay_journal(journal_name.c_str(), image_hash, disk, &journal_length)) {
+        case JOURNAL_NONE:
+            break;
+        case JOURNAL_APPLIED:
+            fprintf(status_out, "Applied reads from %s\n", journal_name.c_str());
+            break;
+        case JOURNAL_STALE:
+            // Left behind after the image was rewritten, so its reads are
+            // already in the image.
+            fprintf(status_out, "Ignoring out-of-date %s\n", journal_name.c_str());
+            break;
+        }
+        open_journal(journal_name.c_str(), image_hash, journal_length, journal);
+        learn_from_image(disk);
+        fprintf(status_out, "Loaded prior image. Retrying failed reads...\n");
     } else {
         init_disk(disk);
         make_disk_comment(PACKAGE_NAME, PACKAGE_VERSION, disk);
@@ -556,36 +1228,33 @@ static int process_floppy(void) {
         }
     }
 
-    std::string filename_in_progress = str_sprintf("%s.in_progress", args.image_filename);
-    FILE* image = fdopen(open(filename_in_progress.c_str(), O_EXCL|O_CREAT|O_WRONLY, image_file_mode), "wb");
-    if (image == NULL) {
-        die_errno("cannot open %s for writing", filename_in_progress.c_str());
-    }
-
-    // Open the /dev/fd* file.
-    {
-        std::string dev_filename = str_sprintf("/dev/fd%d", args.drive);
-        printf("opening %s\n", dev_filename.c_str());
-
-        dev_fd = open(dev_filename.c_str(), O_ACCMODE | O_NONBLOCK);
-        if (dev_fd == -1) {
-            die_errno("cannot open %s", dev_filename.c_str());
+    // A new image is written as we go along. (When retrying, the journal is
+    // written instead.)
+    if (!retrying) {
+        const std::string filename = str_sprintf("%s.in_progress", args.image_filename);
+        image_out.fd = open(filename.c_str(), O_EXCL|O_CREAT|O_WRONLY, image_file_mode);
+        if (image_out.fd == -1) {
+            die_errno("cannot open %s for writing", filename.c_str());
         }
+        image_out.filename = filename;
     }
 
-    // Get BIOS parameters for drive.
-    // These aren't necessarily accurate (e.g. there's no BIOS type for an
-    // 80-track 5.25" DD drive)...
-    struct floppy_drive_params drive_params;
-    if (ioctl(dev_fd, FDGETDRVPRM, &drive_params) < 0) {
-        die_errno("cannot get drive parameters");
+    // Open the /dev/fd* file, the simulator, or a trace to replay.
+    if (args.replay_trace != NULL) {
+        open_replay_fdc(args.replay_trace, status_out, fdc);
+    } else if (args.simulate != NULL) {
+        open_sim_fdc(args.simulate, status_out, fdc);
+    } else {
+        open_drive_fdc(args.drive, status_out, fdc);
+    }
+    if (args.record_trace != NULL) {
+        fdc_t inner = fdc;
+        open_trace_fdc(args.record_trace, inner, fdc);
     }
+    const int drive_tracks = fdc.drive_tracks(fdc);
 
     // Reset the controller
-    if (ioctl(dev_fd, FDRESET, (void *) FD_RESET_ALWAYS) < 0) {
-        die_errno("cannot reset controller");
-    }
-    // FIXME: comment in fdrawcmd.1 says reset may block -- not O_NONBLOCK?
+    fdc.reset(fdc);
 
     // Return to track 0
     for (int i = 0; i < 2; i++) {
@@ -594,10 +1263,10 @@ static int process_floppy(void) {
     }
 
     if (retrying) {
-        printf("Using previously probed disk cyls/heads from %s\n", args.image_filename);
+        fprintf(status_out, "Using previously probed disk cyls/heads from %s\n", args.image_filename);
     } else {
         if (args.tracks == -1) {
-            disk.num_phys_cyls = drive_params.tracks;
+            disk.num_phys_cyls = drive_tracks;
         } else {
             disk.num_phys_cyls = args.tracks;
         }
@@ -607,79 +1276,298 @@ static int process_floppy(void) {
         disk.num_phys_cyls /= args.cyl_scale;
     }
 
-    write_imd_header(disk, image);
+    // Each track is encoded and written with a single write, so the image
+    // is always a whole number of tracks long. That's done by another
+    // thread as the tracks are finished, so the drive can carry on with the
+    // next one.
+    std::vector<uint8_t> image_buf;
+    if (image_out.fd != -1) {
+        encode_imd_header(disk, image_buf);
+        write_all(image_out.fd, &image_buf[0], image_buf.size());
+        start_track_writer(image_out.fd, image_out.writer);
+        image_out.writing = true;
+    }
 
     // FIXME: if retrying, ensure we've moved the head across the disk
     // FIXME: if retrying, turn the motor off and on (delay? close?) ioctl(fd,FDTWADDLE)?
     for (int cyl = 0; cyl < disk.num_phys_cyls; cyl++) {
         for (int head = 0; head < disk.num_phys_heads; head++) {
-            track_t& track = disk.tracks[cyl][head];
-
-            if (args.always_probe || retrying) {
+            track_t& track = disk_track(disk, cyl, head);
+            if (args.always_probe || track.status != TRACK_UNKNOWN) {
                 // Don't assume a layout.
-            } else if (cyl > 0) {
-                // Try the layout of the previous cyl on the same head.
-                copy_track_layout(disk.tracks[cyl - 1][head], track);
+            } else {
+                // Try the layout the tracks we've seen so far suggest, if
+                // it looks right.
+                predict_layout(track);
+                if (track.status == TRACK_GUESSED) {
+                    check_guessed_layout(track);
+                }
             }
+        }
 
-            for (int try_num = 0; try_num < args.max_tries; try_num++) {
+        // Try reading both sides at once.
+        bool read_both = false;
+        if (disk.num_phys_heads == 2 && !retrying) {
+            read_both = read_cylinder(disk_track(disk, cyl, 0), disk_track(disk, cyl, 1));
+        }
+
+        for (int head = 0; head < disk.num_phys_heads; head++) {
+            track_t& track = disk_track(disk, cyl, head);
+
+            // Once the track's been read, there are max_tries reads for
+            // each sector that failed. Sectors that settle give their reads
+            // up to the ones that are still coming back different, which
+            // can go on being read after max_tries passes for as long as
+            // each pass turns up new data.
+            int probe_tries = 0;
+            int passes = 0;
+            int budget = -1;
+            int last_variants = 0;
+            while (!read_both) {
                 if (read_track(track, retrying)) {
                     // Success!
                     break;
                 }
 
-                if (track.status == TRACK_GUESSED) {
+                if (track.status == TRACK_GUESSED && !all_sectors_found(track)) {
                     // Maybe we guessed wrong. Probe and try again.
-                    assert(try_num == 0);
-                    try_num = -1; // Ensure at least one "retry" (sort of a first real try in a way).
                     init_track(cyl, head, track);
+                    continue;
+                }
+                if (track.status == TRACK_UNKNOWN) {
+                    if (++probe_tries == args.max_tries) break;
+                    continue;
                 }
+
+                passes++;
+                int unsettled, variants;
+                unsettled_sectors(track, &unsettled, &variants);
+                const bool disagreeing = variants > last_variants;
+                last_variants = variants;
+                if (budget == -1) {
+                    budget = unsettled * (args.max_tries - 1);
+                }
+                if (unsettled == 0 || budget < unsettled
+                    || (passes >= args.max_tries && !disagreeing)) {
+                    if (unsettled != 0) {
+                        fprintf(status_out, "Gave up %2d.%d: %d sectors not read; another pass would get %.2f of them\n",
+                                track.phys_cyl, track.phys_head, unsettled, retry_gain(track, passes));
+                    }
+                    break;
+                }
+                budget -= unsettled;
+            }
+            if (track.status != TRACK_UNKNOWN) {
+                learn_geometry(track);
             }
 
-            write_imd_track(track, image);
-            fflush(image);
+            if (image_out.writing) {
+                queue_track(image_out.writer, track);
+            }
         }
     }
 
-    fclose(image);
-    close(dev_fd);
+    if (image_out.writing) {
+        finish_track_writer(image_out.writer);
+        image_out.writing = false;
+    }
+    if (image_out.fd != -1) {
+        close(image_out.fd);
+        image_out.fd = -1;
+    }
+    fprintf(status_out, "\nDrive time: %.2fs (%.1f revolutions)\n",
+           fdc.busy_time, fdc.busy_time / fdc.rev_time);
+    close_fdc(fdc);
 
     long secstat[SECTOR_ENUM_HIGHEST+1] = {0};
     {
         for (int phys_cyl = 0; phys_cyl < disk.num_phys_cyls; phys_cyl++) {
             for (int phys_head = 0; phys_head < disk.num_phys_heads; phys_head++) {
-                for (int phys_sec = 0; phys_sec < disk.tracks[phys_cyl][phys_head].num_sectors; phys_sec++) {
-                    secstat[disk.tracks[phys_cyl][phys_head].sectors[phys_sec].status]++;
+                const track_t& track = disk_track(disk, phys_cyl, phys_head);
+                for (int phys_sec = 0; phys_sec < track.num_sectors; phys_sec++) {
+                    secstat[track.sectors[phys_sec].status]++;
                 }
             }
         }
-        printf("\nSector statuses:\nGood:    %ld\nBad:     %ld\nMissing: %ld\n", secstat[SECTOR_GOOD], secstat[SECTOR_BAD], secstat[SECTOR_MISSING]);
+        fprintf(status_out, "\nSector statuses:\nGood:    %ld\nBad:     %ld\nMissing: %ld\n", secstat[SECTOR_GOOD], secstat[SECTOR_BAD], secstat[SECTOR_MISSING]);
     }
 
-    if (rename(filename_in_progress.c_str(), args.image_filename) != 0) {
-        die_errno("rename \"%s\" to \"%s\" failed", filename_in_progress.c_str(), args.image_filename);
+    if (!retrying) {
+        if (rename(image_out.filename.c_str(), args.image_filename) != 0) {
+            die_errno("rename \"%s\" to \"%s\" failed", image_out.filename.c_str(), args.image_filename);
+        }
+        image_out.filename.clear();
+        update_imdx(args.image_filename);
+    } else {
+        // Compact the journal into the image once there's nothing left to
+        // retry, or once replaying it costs more than rewriting the image.
+        struct stat journal_stat;
+        if (fstat(journal.fd, &journal_stat) != 0) {
+            die_errno("stat failed on %s", journal_name.c_str());
+        }
+        const bool all_good = !secstat[SECTOR_BAD] && !secstat[SECTOR_MISSING];
+        if (all_good || journal_stat.st_size > image_size || args.read_comment) {
+            fprintf(status_out, "Writing %s\n", args.image_filename);
+            write_image(disk, args.image_filename, image_file_mode);
+            if (unlink(journal_name.c_str()) != 0) {
+                die_errno("cannot remove %s", journal_name.c_str());
+            }
+            update_imdx(args.image_filename);
+        }
+        close_journal(journal);
     }
 
     return (secstat[SECTOR_BAD] || secstat[SECTOR_MISSING]) ? 1 : 0;
 }
 
+// Give up on a capture that's failed part way through: close whatever it
+// had open, and remove the image it was writing.
+static void abandon_capture(void) {
+    if (image_out.writing) {
+        image_out.writing = false;
+        try {
+            finish_track_writer(image_out.writer);
+        } catch (const fatal_error_t&) {
+            // The writer failed too; the first error is the one reported.
+        }
+    }
+    if (image_out.fd != -1) {
+        close(image_out.fd);
+        image_out.fd = -1;
+    }
+    if (!image_out.filename.empty()) {
+        unlink(image_out.filename.c_str());
+        image_out.filename.clear();
+    }
+    if (fdc.state != NULL) {
+        close_fdc(fdc);
+    }
+    close_journal(journal);
+}
+
+// Read a disk into args.image_filename. If die() throws (see
+// throw_fatal_errors), the capture is abandoned before the error's passed
+// on.
+static int process_floppy(void) {
+    disk_t disk;
+    init_disk(disk);
+    image_out.fd = -1;
+    image_out.writing = false;
+    fdc.state = NULL;
+    journal.fd = -1;
+
+    int result;
+    try {
+        result = dump_disk(disk);
+    } catch (const fatal_error_t&) {
+        abandon_capture();
+        free_disk(disk);
+        throw;
+    }
+    free_disk(disk);
+    return result;
+}
+
+// A drive being imaged by a thread of its own.
+typedef struct {
+    struct args args;
+    pthread_t thread;
+    int result;
+} capture_t;
+
+// When several drives are being imaged, their status output is written to
+// stdout a line at a time, with the image's name in front, so that the
+// drives' lines don't get mixed up.
+typedef struct {
+    std::string prefix;
+    std::string line;
+} prefixed_out_t;
+static pthread_mutex_t stdout_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void write_prefixed(prefixed_out_t& pout, size_t len) {
+    pthread_mutex_lock(&stdout_lock);
+    fprintf(stdout, "%s%.*s\n", pout.prefix.c_str(), (int) len, pout.line.c_str());
+    fflush(stdout);
+    pthread_mutex_unlock(&stdout_lock);
+    pout.line.erase(0, len + 1);
+}
+
+static ssize_t prefixed_write(void *cookie, const char *buf, size_t size) {
+    prefixed_out_t& pout = *(prefixed_out_t *) cookie;
+    pout.line.append(buf, size);
+    size_t end;
+    while ((end = pout.line.find('\n')) != std::string::npos) {
+        write_prefixed(pout, end);
+    }
+    return size;
+}
+
+static int prefixed_close(void *cookie) {
+    prefixed_out_t& pout = *(prefixed_out_t *) cookie;
+    if (!pout.line.empty()) {
+        write_prefixed(pout, pout.line.size());
+    }
+    return 0;
+}
+
+static void *capture_main(void *arg) {
+    capture_t& capture = *(capture_t *) arg;
+    args = capture.args;
+
+    prefixed_out_t pout;
+    pout.prefix = str_sprintf("%s: ", args.image_filename);
+    cookie_io_functions_t funcs = { NULL, prefixed_write, NULL, prefixed_close };
+    status_out = fopencookie(&pout, "w", funcs);
+    if (status_out == NULL) {
+        die_errno("fopencookie failed");
+    }
+
+    // A fatal error only stops this drive.
+    throw_fatal_errors();
+    try {
+        capture.result = process_floppy();
+    } catch (const fatal_error_t& error) {
+        fprintf(status_out, "%s\n", error.message.c_str());
+        capture.result = 1;
+    }
+    fclose(status_out);
+    return NULL;
+}
+
 static void usage(void) {
     fprintf(stderr,
-        "usage: dumpfloppy [OPTION]... IMAGE-FILE\n"
+        "usage: dumpfloppy [OPTION]... IMAGE-FILE...\n"
         "  -a         probe each track before reading\n"
-        "  -d NUM     drive number to read from (default 0)\n"
+        "  -d NUM     drive number to read from (default 0); give one for\n"
+        "             each IMAGE-FILE to read several drives at once\n"
         "  -t TRACKS  drive has TRACKS tracks (default autodetect)\n"
         "  -C         read comment from stdin\n"
         "  -S SEC     ignore sectors with logical ID SEC\n"
-        "  -m NUM     max reads of a failed sector (default 10)\n"
+        "  -m NUM     average reads of each failed sector (default 10)\n"
+        "  -c NUM     stop reading a bad sector once one version of its data\n"
+        "             has come back NUM times more than any other (default 3;\n"
+        "             0 to always use all the reads)\n"
         "  -r         perform retry on existing IMD file.\n"
+        "  -s SPEC    read from a simulated drive rather than a real one (give\n"
+        "             one for each IMAGE-FILE), where\n"
+        "             SPEC is IMD-FILE[,SETTING=VALUE]...; settings are:\n"
+        "               crc=P      sector data has CRC errors with probability P\n"
+        "               missing=P  sector IDs go missing with probability P\n"
+        "               seed=N     random seed for faults\n"
+        "               rpm=N      rotation speed (default 300)\n"
+        "               step=N     steps per cylinder (2 for 40T disk in 80T drive)\n"
+        "               tracks=N   tracks in the drive (default from image)\n"
+        "               latency=MS delay before each command starts (default 0.1)\n"
+        "  -T FILE    record the commands sent to the drive in a trace FILE\n"
+        "  -R FILE    read from a trace FILE rather than a drive\n"
     );
 
     // FIXME: -h HEAD     read single-sided image from head HEAD
 }
 
 int main(int argc, char **argv) {
-    dev_fd = -1;
+    std::vector<int> drives;
+    std::vector<const char *> simulates;
     args.always_probe = false;
     args.drive = 0;
     args.tracks = -1;
@@ -688,9 +1576,14 @@ int main(int argc, char **argv) {
     args.ignore_sector = -1;
     args.image_filename = NULL;
     args.max_tries = 10;
+    args.confidence = 3;
+    args.retry = false;
+    args.simulate = NULL;
+    args.record_trace = NULL;
+    args.replay_trace = NULL;
 
     while (true) {
-        int opt = getopt(argc, argv, "ad:t:CS:m:r");
+        int opt = getopt(argc, argv, "ad:t:CS:m:c:rs:T:R:");
         if (opt == -1) break;
 
         switch (opt) {
@@ -698,7 +1591,7 @@ int main(int argc, char **argv) {
             args.always_probe = true;
             break;
         case 'd':
-            args.drive = atoi(optarg);
+            drives.push_back(atoi(optarg));
             break;
         case 't':
             args.tracks = atoi(optarg);
@@ -712,21 +1605,70 @@ int main(int argc, char **argv) {
         case 'm':
             args.max_tries = atoi(optarg);
             break;
+        case 'c':
+            args.confidence = atoi(optarg);
+            break;
         case 'r':
             args.retry = true;
             break;
+        case 's':
+            simulates.push_back(optarg);
+            break;
+        case 'T':
+            args.record_trace = optarg;
+            break;
+        case 'R':
+            args.replay_trace = optarg;
+            break;
         default:
             usage();
             return 1;
         }
     }
 
-    if (optind + 1 == argc) {
-        args.image_filename = argv[optind];
-    } else {
+    // Each image is read from the drive (or simulated drive) given in the
+    // same position.
+    const int num_images = argc - optind;
+    if (num_images < 1
+        || (!simulates.empty() && (int) simulates.size() != num_images)
+        || (simulates.empty() && num_images > 1 && (int) drives.size() != num_images)
+        || (simulates.empty() && num_images == 1 && drives.size() > 1)) {
         usage();
         return 1;
     }
 
-    return process_floppy();
+    // Pick the data kernels now, rather than in several threads at once --
+    // even one drive has a track writer thread alongside it.
+    init_kernels();
+
+    if (num_images == 1) {
+        args.image_filename = argv[optind];
+        if (!drives.empty()) args.drive = drives[0];
+        if (!simulates.empty()) args.simulate = simulates[0];
+        status_out = stdout;
+        return process_floppy();
+    }
+
+    if (args.read_comment || args.record_trace != NULL || args.replay_trace != NULL) {
+        die("-C, -T and -R can only be used with one drive");
+    }
+
+    std::vector<capture_t> captures(num_images);
+    for (int i = 0; i < num_images; i++) {
+        capture_t& capture = captures[i];
+        capture.args = args;
+        capture.args.image_filename = argv[optind + i];
+        if (!drives.empty()) capture.args.drive = drives[i];
+        if (!simulates.empty()) capture.args.simulate = simulates[i];
+        if (pthread_create(&capture.thread, NULL, capture_main, &capture) != 0) {
+            die("cannot create capture thread");
+        }
+    }
+
+    int result = 0;
+    for (int i = 0; i < num_images; i++) {
+        pthread_join(captures[i].thread, NULL);
+        result = std::max(result, captures[i].result);
+    }
+    return result;
 }
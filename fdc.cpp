@@ -0,0 +1,120 @@
+/*
+    fdc.cpp: interface to a real floppy disk controller
+
+    Copyright (C) 2013 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "fdc.h"
+#include "util.h"
+
+#include <fcntl.h>
+#include <linux/fd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+
+typedef struct {
+    int fd;
+    pthread_mutex_t *controller_lock;
+} drive_fdc_t;
+
+// Drives 0-3 are on the first controller, and 4-7 on the second. When
+// several drives are being read at once, only one of them can be using a
+// controller at a time -- the kernel would make the others wait anyway,
+// but a reset affects every drive on the controller, so we mustn't do one
+// in the middle of another drive's command.
+static pthread_mutex_t controller_locks[2] = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER
+};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int drive_raw_cmd(fdc_t& fdc, struct floppy_raw_cmd& cmd) {
+    drive_fdc_t *drive = (drive_fdc_t *) fdc.state;
+    pthread_mutex_lock(drive->controller_lock);
+    const double start = now();
+    int rc = ioctl(drive->fd, FDRAWCMD, &cmd);
+    fdc.busy_time += now() - start;
+    pthread_mutex_unlock(drive->controller_lock);
+    return rc;
+}
+
+static int drive_tracks(fdc_t& fdc) {
+    drive_fdc_t *drive = (drive_fdc_t *) fdc.state;
+    struct floppy_drive_params drive_params;
+    if (ioctl(drive->fd, FDGETDRVPRM, &drive_params) < 0) {
+        die_errno("cannot get drive parameters");
+    }
+    return drive_params.tracks;
+}
+
+static void drive_reset(fdc_t& fdc) {
+    drive_fdc_t *drive = (drive_fdc_t *) fdc.state;
+    pthread_mutex_lock(drive->controller_lock);
+    const int rc = ioctl(drive->fd, FDRESET, (void *) FD_RESET_ALWAYS);
+    pthread_mutex_unlock(drive->controller_lock);
+    if (rc < 0) {
+        die_errno("cannot reset controller");
+    }
+    // FIXME: comment in fdrawcmd.1 says reset may block -- not O_NONBLOCK?
+}
+
+static void drive_close(fdc_t& fdc) {
+    drive_fdc_t *drive = (drive_fdc_t *) fdc.state;
+    close(drive->fd);
+    delete drive;
+}
+
+void open_drive_fdc(int drive_num, FILE *out, fdc_t& fdc) {
+    std::string dev_filename = str_sprintf("/dev/fd%d", drive_num);
+    fprintf(out, "opening %s\n", dev_filename.c_str());
+
+    // Open the device first, so there's nothing to free if it fails.
+    const int fd = open(dev_filename.c_str(), O_ACCMODE | O_NONBLOCK);
+    if (fd == -1) {
+        die_errno("cannot open %s", dev_filename.c_str());
+    }
+    drive_fdc_t *drive = new drive_fdc_t;
+    drive->fd = fd;
+    drive->controller_lock = &controller_locks[(drive_num / 4) % 2];
+
+    fdc.raw_cmd = drive_raw_cmd;
+    fdc.drive_tracks = drive_tracks;
+    fdc.reset = drive_reset;
+    fdc.close = drive_close;
+    fdc.state = drive;
+    fdc.busy_time = 0.0;
+    fdc.rev_time = 60.0 / 300; // Most drives; 5.25" HD drives are 360rpm.
+}
+
+void close_fdc(fdc_t& fdc) {
+    fdc.close(fdc);
+    fdc.state = NULL;
+}
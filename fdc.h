@@ -0,0 +1,104 @@
+/*
+    fdc.h: interface to a floppy disk controller
+
+    Copyright (C) 2013 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+    dumpfloppy talks to the controller with raw commands, in the form the
+    Linux FDRAWCMD ioctl takes them. An fdc_t sends them either to a real
+    drive, or to a simulated drive with an IMD image in it; the commands
+    can be recorded in a trace file, and the trace played back later.
+*/
+
+#ifndef FDC_H
+#define FDC_H
+
+#include "disk.h"
+
+#include <linux/fd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct fdc fdc_t;
+struct fdc {
+    // Run a command, filling in the reply (and the data, for a read).
+    // Return -1 and set errno if the command couldn't be run at all.
+    int (*raw_cmd)(fdc_t& fdc, struct floppy_raw_cmd& cmd);
+    // Return the number of tracks the drive has, as far as the BIOS knows.
+    // (This isn't necessarily accurate -- e.g. there's no BIOS type for an
+    // 80-track 5.25" DD drive.)
+    int (*drive_tracks)(fdc_t& fdc);
+    // Reset the controller.
+    void (*reset)(fdc_t& fdc);
+    void (*close)(fdc_t& fdc);
+    void *state;
+
+    // Time the drive has spent running commands, in seconds, and the time
+    // the disk takes to go round once.
+    double busy_time;
+    double rev_time;
+};
+
+// Open a real drive, /dev/fdN, saying so on out.
+void open_drive_fdc(int drive, FILE *out, fdc_t& fdc);
+
+// Open a simulated drive, saying so on out. spec is an IMD filename,
+// optionally followed by comma-separated settings:
+//   crc=P      a good sector's data has a CRC error with probability P
+//   missing=P  a sector ID isn't seen with probability P
+//   seed=N     seed for the faults
+//   rpm=N      rotation speed (default 300)
+//   step=N     the drive steps N times per cylinder of the image (2 to
+//              simulate a 40-track disk in an 80-track drive)
+//   tracks=N   the drive has N tracks (default: enough for the image)
+//   latency=MS each command takes MS milliseconds to get going (default
+//              0.1; a longer latency means sectors can be missed if
+//              they're read in physical order)
+void open_sim_fdc(const char *spec, FILE *out, fdc_t& fdc);
+
+// What a simulated drive gets when it reads a sector's data field.
+typedef struct {
+    bool missing; // There's no data address mark
+    bool crc_error;
+    const uint8_t *data; // The sector's data, unless it's missing
+    uint16_t crc; // The CRC written on the disk after the data
+} sim_read_t;
+
+typedef void (*sim_read_fn)(void *ctx, const track_t& track, int phys_sec,
+                            sim_read_t& read);
+
+// Open a simulated drive with a disk built by the caller, taking it over
+// with move_disk (so disk is left empty). Rather than going by the sectors'
+// statuses, each read of a sector's data calls read_sector to find out what
+// it gets. There are no faults, and the drive has the given number of
+// tracks, one for each cylinder of the disk.
+void open_sim_disk_fdc(disk_t& disk, int tracks, double rev_time,
+                       sim_read_fn read_sector, void *ctx, fdc_t& fdc);
+
+// Wrap inner, recording every command sent to it and its result in a
+// trace file. Closing fdc closes inner too.
+void open_trace_fdc(const char *filename, fdc_t& inner, fdc_t& fdc);
+
+// Play back a trace recorded by open_trace_fdc, saying so on out -- and,
+// when it's closed, how the replay went.
+void open_replay_fdc(const char *filename, FILE *out, fdc_t& fdc);
+
+void close_fdc(fdc_t& fdc);
+
+#endif
@@ -0,0 +1,535 @@
+/*
+    fdcsim.cpp: a simulated floppy disk controller, reading from an image
+
+    Copyright (C) 2013 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+    The simulated disk spins at a constant speed, with the sectors of each
+    track spaced evenly around it in the order they appear in the image --
+    so an interleaved image gives an interleaved track. Commands take as
+    long as they would on a real drive: a READ ID waits for the next ID to
+    come round, a READ DATA waits for the sector it wants, and a command
+    that can't find what it wants gives up at the second index pulse.
+
+    Good sectors read back as their data (unless a CRC fault is injected),
+    bad sectors read back as one of their variants with a CRC error, and
+    sectors with no data have a missing data address mark. A READ DATA
+    asking for a bigger size than a sector's ID gives goes on past the end
+    of its data field, returning the CRC written on the disk after the data
+    and then gap bytes, as many PC controllers do; the CRC is the right one
+    for a good sector's data, and matches none of a bad sector's variants.
+
+    A drive can also be opened with a disk and a function that decides what
+    each read of a sector gets, which is how a trace is played back once
+    dumpfloppy's commands stop matching it.
+
+    Only the commands dumpfloppy uses are simulated: RECALIBRATE, READ ID,
+    READ DATA and READ DELETED DATA (with the MT and SK bits).
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "crc.h"
+#include "disk.h"
+#include "fdc.h"
+#include "imd.h"
+#include "util.h"
+
+#include <linux/fd.h>
+#include <linux/fdreg.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Where things are on a track, as fractions of a revolution from the index.
+#define TRACK_START 0.02 // Gap after the index before the first sector
+#define TRACK_USED 0.96 // Sectors are spread over this much of the track
+#define ID_LENGTH 0.05 // Length of an ID field, as a fraction of a sector
+#define DATA_START 0.1 // Data field start and end, as fractions of a sector
+#define DATA_END 0.9
+
+#define STEP_TIME 0.003 // Seconds to step the head one track
+#define SETTLE_TIME 0.015 // Seconds for the head to settle after stepping
+
+#define ST0_ABNORMAL 0x40 // Interrupt code 01: abnormal termination
+
+typedef struct {
+    disk_t disk;
+    double crc_rate;
+    double missing_rate;
+    uint64_t random;
+    int step;
+    int tracks;
+    double command_time; // Seconds of overhead per command
+    // If not NULL, called to find out what a read of a sector's data gets.
+    sim_read_fn read_sector;
+    void *read_ctx;
+
+    double now; // Seconds since the simulation started
+    int head_track; // Physical track the head is over
+} sim_t;
+
+// Get the track under a head, or NULL if it's unformatted or can't be read
+// in the mode the command uses.
+static const track_t *sim_track(sim_t& sim, const struct floppy_raw_cmd& cmd,
+                                int head) {
+    if (sim.head_track % sim.step != 0) return NULL;
+
+    const track_t *track = find_track(sim.disk, sim.head_track / sim.step, head);
+    if (track == NULL || track->num_sectors == 0 || track->data_mode == NULL) {
+        return NULL;
+    }
+    const bool is_fm = (cmd.cmd[0] & 0x40) == 0;
+    if (track->data_mode->rate != cmd.rate || track->data_mode->is_fm != is_fm) {
+        return NULL;
+    }
+    return track;
+}
+
+// Return when the ID field of a sector starts, within a revolution.
+static double id_pos(const track_t& track, int phys_sec) {
+    return TRACK_START + (TRACK_USED * phys_sec) / track.num_sectors;
+}
+
+static double sector_length(const track_t& track) {
+    return TRACK_USED / track.num_sectors;
+}
+
+// Return the time of the second index pulse after now, when the controller
+// gives up looking for something.
+static double give_up_time(const sim_t& sim, const fdc_t& fdc) {
+    return (floor(sim.now / fdc.rev_time) + 2) * fdc.rev_time;
+}
+
+// Wait for the next sector ID to pass under the head that matches want (a
+// C/H/R/N, where N may be bigger than the ID's), or any ID if want is NULL. Return the physical sector, with
+// sim.now at the end of the ID field -- or -1 if nothing was found before
+// deadline, with sim.now at the deadline.
+static int sim_find_id(sim_t& sim, const fdc_t& fdc, const track_t *track,
+                       const uint8_t *want, double deadline) {
+    if (track == NULL) {
+        sim.now = deadline;
+        return -1;
+    }
+
+    // Start with the first ID that hasn't started passing yet.
+    double rev = floor(sim.now / fdc.rev_time);
+    const double pos = sim.now / fdc.rev_time - rev;
+    int phys_sec = 0;
+    while (phys_sec < track->num_sectors && id_pos(*track, phys_sec) < pos) {
+        phys_sec++;
+    }
+
+    while (true) {
+        if (phys_sec == track->num_sectors) {
+            phys_sec = 0;
+            rev += 1.0;
+        }
+        const double start = (rev + id_pos(*track, phys_sec)) * fdc.rev_time;
+        if (start >= deadline) {
+            sim.now = deadline;
+            return -1;
+        }
+
+        const sector_t& sector = track->sectors[phys_sec];
+        const bool matches = want == NULL
+                             || (sector.log_cyl == want[0]
+                                 && sector.log_head == want[1]
+                                 && sector.log_sector == want[2]
+                                 && track->sector_size_code <= want[3]);
+        if (matches && random_fraction(sim.random) >= sim.missing_rate) {
+            sim.now = start + ID_LENGTH * sector_length(*track) * fdc.rev_time;
+            return phys_sec;
+        }
+        phys_sec++;
+    }
+}
+
+static void sim_seek(sim_t& sim, const struct floppy_raw_cmd& cmd) {
+    if ((cmd.flags & FD_RAW_NEED_SEEK) == 0) return;
+
+    const int distance = abs(int(cmd.track) - sim.head_track);
+    if (distance > 0) {
+        sim.now += distance * STEP_TIME + SETTLE_TIME;
+        sim.head_track = cmd.track;
+    }
+}
+
+static void sim_recalibrate(sim_t& sim, struct floppy_raw_cmd& cmd) {
+    sim.now += sim.head_track * STEP_TIME + SETTLE_TIME;
+    sim.head_track = 0;
+
+    cmd.reply[0] = ST0_SE | (cmd.cmd[1] & ST0_DS);
+    cmd.reply[1] = 0;
+    cmd.reply_count = 2;
+}
+
+static void sim_read_id(sim_t& sim, const fdc_t& fdc,
+                        struct floppy_raw_cmd& cmd) {
+    const int head = (cmd.cmd[1] >> 2) & 1;
+    const track_t *track = sim_track(sim, cmd, head);
+
+    uint8_t *reply = cmd.reply;
+    reply[0] = (head << 2) | (cmd.cmd[1] & ST0_DS);
+    reply[1] = reply[2] = 0;
+    const int phys_sec = sim_find_id(sim, fdc, track, NULL, give_up_time(sim, fdc));
+    if (phys_sec == -1) {
+        reply[0] |= ST0_ABNORMAL;
+        reply[1] |= ST1_MAM;
+        memset(reply + 3, 0, 4);
+    } else {
+        const sector_t& sector = track->sectors[phys_sec];
+        reply[3] = sector.log_cyl;
+        reply[4] = sector.log_head;
+        reply[5] = sector.log_sector;
+        reply[6] = track->sector_size_code;
+    }
+    cmd.reply_count = 7;
+}
+
+// Get the version of a sector's data that was read the most times -- for a
+// good sector, in case a bad read is in there too.
+static const data_variant_t& sim_best_variant(const sector_t& sector) {
+    size_t best = 0;
+    for (size_t i = 1; i < sector.datas.size(); i++) {
+        if (sector.datas[i].count > sector.datas[best].count) {
+            best = i;
+        }
+    }
+    return sector.datas[best];
+}
+
+// Get the CRC written on the disk after a sector's data.
+static uint16_t sim_data_crc(const track_t& track, const sector_t& sector) {
+    const data_variant_t& variant = sim_best_variant(sector);
+    const uint16_t crc = data_field_crc(track.data_mode->is_fm, sector.deleted,
+                                        variant.data(), variant.length());
+    return sector.status == SECTOR_GOOD ? crc : crc ^ 0xFFFF;
+}
+
+// Get what a read of a sector returns, and whether it has a CRC error.
+static const uint8_t *sim_sector_data(sim_t& sim, const sector_t& sector,
+                                      std::vector<uint8_t>& buf, bool& crc_error) {
+    if (sector.status == SECTOR_GOOD) {
+        const data_variant_t& variant = sim_best_variant(sector);
+        crc_error = random_fraction(sim.random) < sim.crc_rate;
+        if (!crc_error) {
+            return variant.data();
+        }
+
+        // Corrupt a few bytes.
+        buf.assign(variant.data(), variant.data() + variant.length());
+        for (int i = 0; i < 3; i++) {
+            buf[next_random(sim.random) % buf.size()] ^= 1 << (next_random(sim.random) % 8);
+        }
+        return &buf[0];
+    }
+
+    // Pick one of the bad reads, as often as they were seen.
+    uint64_t total = 0;
+    for (size_t i = 0; i < sector.datas.size(); i++) {
+        total += sector.datas[i].count;
+    }
+    uint64_t pick = next_random(sim.random) % total;
+    size_t i = 0;
+    while (pick >= sector.datas[i].count) {
+        pick -= sector.datas[i].count;
+        i++;
+    }
+    crc_error = true;
+    return sector.datas[i].data();
+}
+
+// Find out what a read of a sector's data field gets.
+static void sim_read_sector(sim_t& sim, const track_t& track, int phys_sec,
+                            std::vector<uint8_t>& buf, sim_read_t& read) {
+    if (sim.read_sector != NULL) {
+        sim.read_sector(sim.read_ctx, track, phys_sec, read);
+        return;
+    }
+
+    const sector_t& sector = track.sectors[phys_sec];
+    read.missing = sector.status == SECTOR_MISSING;
+    if (!read.missing) {
+        read.data = sim_sector_data(sim, sector, buf, read.crc_error);
+        read.crc = sim_data_crc(track, sector);
+    }
+}
+
+static void sim_read_data(sim_t& sim, const fdc_t& fdc,
+                          struct floppy_raw_cmd& cmd) {
+    const bool multi_track = (cmd.cmd[0] & 0x80) != 0;
+    const bool skip_other = (cmd.cmd[0] & 0x20) != 0;
+    const bool want_deleted = (cmd.cmd[0] & 0x1F) == 0x0C;
+    int head = (cmd.cmd[1] >> 2) & 1;
+    uint8_t want[4] = { cmd.cmd[2], cmd.cmd[3], cmd.cmd[4], cmd.cmd[5] };
+    const uint8_t eot = cmd.cmd[6];
+
+    uint8_t *data = (uint8_t *) cmd.data;
+    long left = cmd.length;
+    uint8_t st0 = cmd.cmd[1] & ST0_DS;
+    uint8_t st1 = 0, st2 = 0;
+    std::vector<uint8_t> buf;
+
+    const track_t *track = sim_track(sim, cmd, head);
+    while (true) {
+        st0 = (st0 & ~ST0_HA) | (head << 2);
+
+        const int phys_sec = sim_find_id(sim, fdc, track, want, give_up_time(sim, fdc));
+        if (phys_sec == -1) {
+            st0 |= ST0_ABNORMAL;
+            st1 |= ST1_ND;
+            break;
+        }
+        const sector_t& sector = track->sectors[phys_sec];
+        const double sector_start = sim.now / fdc.rev_time - ID_LENGTH * sector_length(*track);
+        sim_read_t read;
+        sim_read_sector(sim, *track, phys_sec, buf, read);
+
+        if (read.missing) {
+            // No data address mark.
+            st0 |= ST0_ABNORMAL;
+            st1 |= ST1_MAM;
+            st2 |= ST2_MAM;
+            break;
+        }
+
+        const bool other_mark = sector.deleted != want_deleted;
+        if (other_mark && skip_other) {
+            // Skip over this sector entirely.
+            sim.now = (sector_start + sector_length(*track) * DATA_END) * fdc.rev_time;
+        } else {
+            bool crc_error = read.crc_error;
+            const long size = sector_bytes(track->sector_size_code);
+            long count = size < left ? size : left;
+            memcpy(data, read.data, count);
+            data += count;
+            left -= count;
+            sim.now = (sector_start + sector_length(*track) * DATA_END) * fdc.rev_time;
+
+            const long want_size = sector_bytes(want[3]);
+            if (want_size > size) {
+                // Carry on reading the CRC and the gap after the data --
+                // which the controller then takes as a CRC error.
+                const uint8_t crc_bytes[2] = { uint8_t(read.crc >> 8), uint8_t(read.crc & 0xFF) };
+                count = std::min(std::min(want_size - size, 2L), left);
+                memcpy(data, crc_bytes, count);
+                data += count;
+                left -= count;
+                count = std::min(want_size - size - 2, left);
+                memset(data, 0x4E, count);
+                data += count;
+                left -= count;
+                sim.now += (want_size - size) * (DATA_END - DATA_START) / size
+                           * sector_length(*track) * fdc.rev_time;
+                crc_error = true;
+            }
+
+            if (other_mark) {
+                st2 |= ST2_CM;
+            }
+            if (crc_error) {
+                st0 |= ST0_ABNORMAL;
+                st1 |= ST1_CRC;
+                st2 |= ST2_CRC;
+                break;
+            }
+            if (other_mark) {
+                // The controller stops after reading a sector with the
+                // other kind of data mark.
+                want[2]++;
+                break;
+            }
+        }
+
+        if (left == 0) {
+            // Terminal count -- the transfer's finished.
+            want[2]++;
+            break;
+        }
+        if (want[2] == eot) {
+            if (multi_track && head == 0) {
+                // Carry on from the first sector on the other side.
+                head = 1;
+                want[1] ^= 1;
+                want[2] = 1;
+                track = sim_track(sim, cmd, head);
+                continue;
+            }
+            st0 |= ST0_ABNORMAL;
+            st1 |= ST1_EOC;
+            want[2]++;
+            break;
+        }
+        want[2]++;
+    }
+
+    cmd.reply[0] = st0;
+    cmd.reply[1] = st1;
+    cmd.reply[2] = st2;
+    memcpy(cmd.reply + 3, want, 4);
+    cmd.reply_count = 7;
+    cmd.length = left;
+}
+
+static int sim_raw_cmd(fdc_t& fdc, struct floppy_raw_cmd& cmd) {
+    sim_t& sim = *(sim_t *) fdc.state;
+    const double start = sim.now;
+
+    sim.now += sim.command_time;
+    sim_seek(sim, cmd);
+    switch (cmd.cmd[0] & 0x1F) {
+    case 0x07: // RECALIBRATE
+        sim_recalibrate(sim, cmd);
+        break;
+    case 0x0A: // READ ID
+        sim_read_id(sim, fdc, cmd);
+        break;
+    case 0x06: // READ DATA
+    case 0x0C: // READ DELETED DATA
+        sim_read_data(sim, fdc, cmd);
+        break;
+    default:
+        die("Simulated controller doesn't support command %02x", cmd.cmd[0]);
+    }
+
+    fdc.busy_time += sim.now - start;
+    return 0;
+}
+
+static int sim_drive_tracks(fdc_t& fdc) {
+    sim_t& sim = *(sim_t *) fdc.state;
+    return sim.tracks;
+}
+
+static void sim_reset(fdc_t& fdc) {
+    (void) fdc;
+}
+
+static void sim_close(fdc_t& fdc) {
+    sim_t *sim = (sim_t *) fdc.state;
+    free_disk(sim->disk);
+    delete sim;
+}
+
+static sim_t *new_sim(void) {
+    sim_t *sim = new sim_t;
+    init_disk(sim->disk);
+    sim->crc_rate = 0.0;
+    sim->missing_rate = 0.0;
+    sim->random = 1;
+    sim->step = 1;
+    sim->tracks = -1;
+    sim->command_time = 0.0001;
+    sim->read_sector = NULL;
+    sim->read_ctx = NULL;
+    sim->now = 0.0;
+    sim->head_track = 0;
+    return sim;
+}
+
+static void install_sim(sim_t *sim, double rev_time, fdc_t& fdc) {
+    fdc.raw_cmd = sim_raw_cmd;
+    fdc.drive_tracks = sim_drive_tracks;
+    fdc.reset = sim_reset;
+    fdc.close = sim_close;
+    fdc.state = sim;
+    fdc.busy_time = 0.0;
+    fdc.rev_time = rev_time;
+}
+
+// Apply the settings in spec to sim and load its disk, returning the time
+// the disk takes to rotate.
+static double setup_sim(sim_t *sim, const char *spec, FILE *out) {
+    uint64_t seed = 1;
+    int rpm = 300;
+
+    // The image filename comes first, then the settings.
+    std::string settings(spec);
+    size_t comma = settings.find(',');
+    std::string filename = settings.substr(0, comma);
+    while (comma != std::string::npos) {
+        const size_t next = settings.find(',', comma + 1);
+        const std::string setting = settings.substr(comma + 1, next == std::string::npos ? std::string::npos : next - comma - 1);
+        comma = next;
+
+        const size_t equals = setting.find('=');
+        if (equals == std::string::npos) {
+            die("Simulator setting \"%s\" should be NAME=VALUE", setting.c_str());
+        }
+        const std::string name = setting.substr(0, equals);
+        const char *value = setting.c_str() + equals + 1;
+        if (name == "crc") {
+            sim->crc_rate = atof(value);
+        } else if (name == "missing") {
+            sim->missing_rate = atof(value);
+        } else if (name == "seed") {
+            seed = strtoull(value, NULL, 10);
+        } else if (name == "rpm") {
+            rpm = atoi(value);
+        } else if (name == "step") {
+            sim->step = atoi(value);
+        } else if (name == "tracks") {
+            sim->tracks = atoi(value);
+        } else if (name == "latency") {
+            sim->command_time = atof(value) / 1000;
+        } else {
+            die("Unknown simulator setting \"%s\"", name.c_str());
+        }
+    }
+    if (rpm <= 0 || sim->step <= 0) {
+        die("Bad simulator settings \"%s\"", spec);
+    }
+    sim->random = seed * 0x9E3779B97F4A7C15ULL + 1;
+
+    fprintf(out, "simulating a drive with %s\n", filename.c_str());
+    map_imd(filename.c_str(), sim->disk);
+    if (sim->tracks == -1) {
+        sim->tracks = sim->disk.num_phys_cyls * sim->step;
+    }
+    return 60.0 / rpm;
+}
+
+void open_sim_fdc(const char *spec, FILE *out, fdc_t& fdc) {
+    sim_t *sim = new_sim();
+    double rev_time;
+    try {
+        rev_time = setup_sim(sim, spec, out);
+    } catch (const fatal_error_t&) {
+        free_disk(sim->disk);
+        delete sim;
+        throw;
+    }
+    install_sim(sim, rev_time, fdc);
+}
+
+void open_sim_disk_fdc(disk_t& disk, int tracks, double rev_time,
+                       sim_read_fn read_sector, void *ctx, fdc_t& fdc) {
+    sim_t *sim = new_sim();
+    move_disk(disk, sim->disk);
+    sim->tracks = tracks;
+    sim->read_sector = read_sector;
+    sim->read_ctx = ctx;
+
+    install_sim(sim, rev_time, fdc);
+}
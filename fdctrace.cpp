@@ -0,0 +1,739 @@
+/*
+    fdctrace.cpp: record and play back traces of floppy controller commands
+
+    Copyright (C) 2013 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+    A trace file is "DFT1", the revolution time in nanoseconds (8 bytes),
+    then one record per call to the controller. Multi-byte values are
+    big-endian.
+
+    'T' drive_tracks: tracks (4)
+    'Z' reset
+    'C' raw_cmd: the command as sent -- flags (4), rate, track, cmd_count,
+        the command bytes, length (4) -- then the result -- return value
+        (4), errno (4), flags (4), reply_count, the reply bytes, remaining
+        length (4), duration in nanoseconds (8) -- then the data read, if
+        any.
+
+    Playing a trace back returns the recorded result for each command, as
+    long as dumpfloppy sends the same commands in the same order as when the
+    trace was recorded. Once it doesn't -- because the capture logic has
+    changed -- the rest of the commands go to a simulated drive (see
+    fdcsim.cpp) with the disk the trace describes in it. Each track has the
+    sector IDs READ IDs found on it, in the order they came round; each read
+    of a sector gets the next result recorded for that sector by READ DATAs
+    of any shape, and once those run out they are reused from the start. A
+    sector that was never read has no data, and a command on a track that
+    was never tried in the same mode is an error.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "crc.h"
+#include "disk.h"
+#include "fdc.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fd.h>
+#include <linux/fdreg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <map>
+#include <set>
+#include <vector>
+
+static const char TRACE_MAGIC[] = "DFT1";
+#define TRACE_MAGIC_LEN 4
+#define TRACE_HEADER_LEN (TRACE_MAGIC_LEN + 8)
+
+#define RECORD_TRACKS 'T'
+#define RECORD_RESET 'Z'
+#define RECORD_CMD 'C'
+
+// Flags that the controller sets, rather than being part of the command.
+#define FD_RAW_OUT_FLAGS (FD_RAW_DISK_CHANGE | FD_RAW_FAILURE | FD_RAW_HARDFAILURE)
+
+// Append the command part of a 'C' record; this is also used as the key
+// for finding a command when playing back.
+static void put_command(std::vector<uint8_t>& buf,
+                        const struct floppy_raw_cmd& cmd) {
+    put_be32(buf, cmd.flags & ~FD_RAW_OUT_FLAGS);
+    buf.push_back(cmd.rate);
+    buf.push_back(cmd.track);
+    buf.push_back(cmd.cmd_count);
+    buf.insert(buf.end(), cmd.cmd, cmd.cmd + cmd.cmd_count);
+    put_be32(buf, cmd.length);
+}
+
+// Return the number of bytes the controller transferred into the buffer.
+static long data_read(const struct floppy_raw_cmd& cmd, long length,
+                      int rc) {
+    if (rc < 0 || (cmd.flags & FD_RAW_READ) == 0) return 0;
+    return length - cmd.length;
+}
+
+typedef struct {
+    fdc_t inner;
+    int fd;
+    std::vector<uint8_t> buf;
+} trace_fdc_t;
+
+static void trace_write(trace_fdc_t& trace) {
+    write_all(trace.fd, &trace.buf[0], trace.buf.size());
+}
+
+static int trace_raw_cmd(fdc_t& fdc, struct floppy_raw_cmd& cmd) {
+    trace_fdc_t& trace = *(trace_fdc_t *) fdc.state;
+
+    trace.buf.clear();
+    trace.buf.push_back(RECORD_CMD);
+    put_command(trace.buf, cmd);
+    const long length = cmd.length;
+
+    const double start = trace.inner.busy_time;
+    const int rc = trace.inner.raw_cmd(trace.inner, cmd);
+    const int saved_errno = errno;
+    const double duration = trace.inner.busy_time - start;
+    fdc.busy_time += duration;
+
+    put_be32(trace.buf, rc);
+    put_be32(trace.buf, rc < 0 ? saved_errno : 0);
+    put_be32(trace.buf, cmd.flags);
+    trace.buf.push_back(cmd.reply_count);
+    trace.buf.insert(trace.buf.end(), cmd.reply, cmd.reply + cmd.reply_count);
+    put_be32(trace.buf, cmd.length);
+    put_be64(trace.buf, (uint64_t) (duration * 1e9));
+    const uint8_t *data = (const uint8_t *) cmd.data;
+    trace.buf.insert(trace.buf.end(), data, data + data_read(cmd, length, rc));
+    trace_write(trace);
+
+    errno = saved_errno;
+    return rc;
+}
+
+static int trace_drive_tracks(fdc_t& fdc) {
+    trace_fdc_t& trace = *(trace_fdc_t *) fdc.state;
+    const int tracks = trace.inner.drive_tracks(trace.inner);
+
+    trace.buf.clear();
+    trace.buf.push_back(RECORD_TRACKS);
+    put_be32(trace.buf, tracks);
+    trace_write(trace);
+    return tracks;
+}
+
+static void trace_reset(fdc_t& fdc) {
+    trace_fdc_t& trace = *(trace_fdc_t *) fdc.state;
+    trace.inner.reset(trace.inner);
+
+    trace.buf.clear();
+    trace.buf.push_back(RECORD_RESET);
+    trace_write(trace);
+}
+
+static void trace_close(fdc_t& fdc) {
+    trace_fdc_t *trace = (trace_fdc_t *) fdc.state;
+    close_fdc(trace->inner);
+    close(trace->fd);
+    delete trace;
+}
+
+void open_trace_fdc(const char *filename, fdc_t& inner, fdc_t& fdc) {
+    trace_fdc_t *trace = new trace_fdc_t;
+    trace->inner = inner;
+    trace->fd = open(filename, O_CREAT|O_TRUNC|O_WRONLY, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+    if (trace->fd == -1) {
+        die_errno("cannot open %s for writing", filename);
+    }
+
+    trace->buf.assign(TRACE_MAGIC, TRACE_MAGIC + TRACE_MAGIC_LEN);
+    put_be64(trace->buf, (uint64_t) (inner.rev_time * 1e9));
+    trace_write(*trace);
+
+    fdc.raw_cmd = trace_raw_cmd;
+    fdc.drive_tracks = trace_drive_tracks;
+    fdc.reset = trace_reset;
+    fdc.close = trace_close;
+    fdc.state = trace;
+    fdc.busy_time = 0.0;
+    fdc.rev_time = inner.rev_time;
+}
+
+typedef struct {
+    size_t key; // Offset of the command part, within the trace
+    size_t key_length;
+    size_t offset; // Of the result
+    long length; // Of the data buffer when the command was sent
+} replay_cmd_t;
+
+// One read of a sector's data field in the trace.
+typedef struct {
+    bool missing;
+    bool crc_error;
+    std::vector<uint8_t> data;
+} replay_read_t;
+
+typedef struct {
+    std::vector<replay_read_t> reads;
+    size_t next; // The next read to give back
+    bool deleted;
+    bool has_crc;
+    uint16_t crc; // The CRC after the data, if has_crc
+} replay_sector_t;
+
+// What the trace says about one side of a track.
+typedef struct {
+    unsigned int modes_tried; // A bit for each DATA_MODES entry tried
+    int mode; // The DATA_MODES entry that found sectors, or -1
+    int size_code; // Or -1 if no sectors were found
+    // Sector IDs, packed by id_key, in the order they were first seen.
+    std::vector<uint32_t> ids;
+    // For each ID, how many times each other ID was read straight after it
+    // by READ IDs in a row.
+    std::map<uint32_t, std::map<uint32_t, int> > next_ids;
+    std::map<uint32_t, replay_sector_t> sectors;
+} replay_track_t;
+
+typedef struct {
+    std::vector<uint8_t> trace;
+    int drive_tracks;
+    std::vector<replay_cmd_t> cmds;
+    std::vector<uint8_t> buf;
+    FILE *out;
+
+    // Once a command's different from the one recorded next, the rest are
+    // answered by a simulated drive with the disk the trace describes.
+    size_t next_cmd;
+    bool modelling;
+    std::map<int, replay_track_t> tracks; // Keyed by track * 2 + head
+    fdc_t model;
+
+    // How many commands got the result they had when recorded, how many
+    // were simulated, how many times a sector's recorded reads ran out and
+    // had to be reused, and how many reads were of sectors that were never
+    // read in the trace.
+    size_t num_cmds;
+    size_t num_modelled;
+    size_t num_reused;
+    size_t num_unknown;
+} replay_fdc_t;
+
+// Parse the result part of a 'C' record at offset, and return its length,
+// or 0 if it's incomplete.
+static size_t result_length(const replay_fdc_t& replay, size_t offset,
+                            long length) {
+    const uint8_t *p = &replay.trace[offset];
+    const size_t avail = replay.trace.size() - offset;
+    if (avail < 13) return 0;
+    const int rc = (int) get_be32(p);
+    const unsigned int flags = get_be32(p + 8);
+    const int reply_count = p[12];
+    size_t len = 13 + reply_count + 4 + 8;
+    if (avail < len) return 0;
+    if (rc >= 0 && (flags & FD_RAW_READ) != 0) {
+        const long remaining = (long) get_be32(p + 13 + reply_count);
+        if (remaining < 0 || remaining > length) return 0;
+        len += length - remaining;
+    }
+    if (avail < len) return 0;
+    return len;
+}
+
+// Fill in cmd with a recorded command and its result, returning the
+// return value, and set errno, duration and data as recorded. The data
+// isn't copied, so cmd.data is left alone.
+static int get_recorded_cmd(const replay_fdc_t& replay, const replay_cmd_t& rec,
+                            struct floppy_raw_cmd& cmd, int *saved_errno,
+                            double *duration, const uint8_t **data) {
+    const uint8_t *p = &replay.trace[rec.key];
+    cmd.rate = p[4];
+    cmd.track = p[5];
+    cmd.cmd_count = p[6];
+    memcpy(cmd.cmd, p + 7, cmd.cmd_count);
+
+    p = &replay.trace[rec.offset];
+    const int rc = (int) get_be32(p);
+    *saved_errno = (int) get_be32(p + 4);
+    cmd.flags = get_be32(p + 8);
+    cmd.reply_count = p[12];
+    memcpy(cmd.reply, p + 13, cmd.reply_count);
+    p += 13 + cmd.reply_count;
+    cmd.length = (long) get_be32(p);
+    *duration = get_be64(p + 4) * 1e-9;
+    *data = p + 12;
+    return rc;
+}
+
+// Return the DATA_MODES entry a command uses, or -1 if there isn't one.
+static int cmd_mode(const struct floppy_raw_cmd& cmd) {
+    const bool is_fm = (cmd.cmd[0] & 0x40) == 0;
+    for (int i = 0; DATA_MODES[i].name != NULL; i++) {
+        if (DATA_MODES[i].rate == cmd.rate && DATA_MODES[i].is_fm == is_fm) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static uint32_t id_key(int log_cyl, int log_head, int log_sector) {
+    return (log_cyl << 16) | (log_head << 8) | log_sector;
+}
+
+static replay_track_t& replay_track(replay_fdc_t& replay, int track, int head) {
+    const int key = track * 2 + head;
+    std::map<int, replay_track_t>::iterator it = replay.tracks.find(key);
+    if (it != replay.tracks.end()) return it->second;
+
+    replay_track_t& t = replay.tracks[key];
+    t.modes_tried = 0;
+    t.mode = -1;
+    t.size_code = -1;
+    return t;
+}
+
+static replay_sector_t& replay_sector(replay_track_t& track, uint32_t id,
+                                      bool deleted) {
+    std::map<uint32_t, replay_sector_t>::iterator it = track.sectors.find(id);
+    if (it != track.sectors.end()) return it->second;
+
+    track.ids.push_back(id);
+    replay_sector_t& sector = track.sectors[id];
+    sector.next = 0;
+    sector.deleted = deleted;
+    sector.has_crc = false;
+    sector.crc = 0;
+    return sector;
+}
+
+static void add_sector_read(replay_track_t& track, uint32_t id, bool deleted,
+                            bool crc_error, const uint8_t *data, long size) {
+    replay_sector_t& sector = replay_sector(track, id, deleted);
+    sector.reads.push_back(replay_read_t());
+    replay_read_t& read = sector.reads.back();
+    read.missing = (data == NULL);
+    read.crc_error = crc_error;
+    if (data != NULL) {
+        read.data.assign(data, data + size);
+    }
+}
+
+// Work out what a recorded READ DATA got from each sector it went over.
+static void note_data_read(replay_fdc_t& replay,
+                           const struct floppy_raw_cmd& cmd,
+                           const uint8_t *data, long transferred) {
+    const bool multi_track = (cmd.cmd[0] & 0x80) != 0;
+    const bool want_deleted = (cmd.cmd[0] & 0x1F) == 0x0C;
+    const bool failed = ((cmd.reply[0] >> 6) & 3) != 0;
+    const bool other_mark = (cmd.reply[2] & ST2_CM) != 0;
+    const bool data_crc_error = failed && (cmd.reply[2] & ST2_CRC) != 0;
+    const bool no_data = failed && (cmd.reply[2] & ST2_MAM) != 0;
+    const int mode = cmd_mode(cmd);
+    int head = (cmd.cmd[1] >> 2) & 1;
+    int log_head = cmd.cmd[3];
+    int log_sec = cmd.cmd[4];
+
+    replay_track_t *track = &replay_track(replay, cmd.track, head);
+    if (track->size_code == -1) {
+        track->size_code = cmd.cmd[5];
+    }
+    const long size = sector_bytes(track->size_code);
+    if (transferred >= size || no_data) {
+        track->mode = mode;
+    }
+
+    if (cmd.cmd[5] > track->size_code) {
+        // A sector read as if it were bigger, to get the CRC after its data
+        // -- which the controller always takes as a CRC error, so whether
+        // the data's right depends on the CRC.
+        const uint32_t id = id_key(cmd.cmd[2], log_head, log_sec);
+        if (no_data) {
+            add_sector_read(*track, id, want_deleted, false, NULL, 0);
+        } else if (transferred >= size + 2) {
+            const bool deleted = want_deleted != other_mark;
+            const uint16_t crc = (data[size] << 8) | data[size + 1];
+            replay_sector_t& sector = replay_sector(*track, id, deleted);
+            sector.has_crc = true;
+            sector.crc = crc;
+            const bool crc_error = data_field_crc(DATA_MODES[mode].is_fm, deleted,
+                                                  data, size) != crc;
+            add_sector_read(*track, id, deleted, crc_error, data, size);
+        }
+        return;
+    }
+
+    // Every sector transferred was read successfully, apart from the last
+    // if the read stopped with a CRC error in its data -- and if it stopped
+    // at a sector with no data, that's the one after them.
+    const long count = transferred / size;
+    for (long i = 0; i <= count; i++) {
+        const uint32_t id = id_key(cmd.cmd[2], log_head, log_sec);
+        const bool last = i == count - 1;
+        if (i == count) {
+            if (no_data) {
+                add_sector_read(*track, id, want_deleted, false, NULL, 0);
+            }
+            break;
+        }
+        add_sector_read(*track, id, want_deleted != (last && other_mark),
+                        last && data_crc_error, data + i * size, size);
+
+        if (log_sec == cmd.cmd[6] && multi_track && head == 0) {
+            head = 1;
+            log_head ^= 1;
+            log_sec = 1;
+            track = &replay_track(replay, cmd.track, head);
+            track->modes_tried |= 1u << mode;
+            if (track->size_code == -1) {
+                track->size_code = cmd.cmd[5];
+            }
+            track->mode = mode;
+        } else {
+            log_sec++;
+        }
+    }
+}
+
+// Put a track's sector IDs in the order they come round the track: start
+// with the first ID seen, and follow the ID that most often came straight
+// after each one. IDs that weren't seen that way (e.g. only in data reads)
+// go at the end.
+static std::vector<uint32_t> id_order(const replay_track_t& track) {
+    std::vector<uint32_t> order;
+    std::set<uint32_t> placed;
+
+    for (size_t i = 0; i < track.ids.size() && order.empty(); i++) {
+        uint32_t id = track.ids[i];
+        while (placed.insert(id).second) {
+            order.push_back(id);
+            std::map<uint32_t, std::map<uint32_t, int> >::const_iterator it
+                = track.next_ids.find(id);
+            if (it == track.next_ids.end()) break;
+
+            int best = 0;
+            for (std::map<uint32_t, int>::const_iterator next = it->second.begin();
+                 next != it->second.end(); ++next) {
+                if (next->second > best) {
+                    best = next->second;
+                    id = next->first;
+                }
+            }
+        }
+    }
+    for (size_t i = 0; i < track.ids.size(); i++) {
+        if (placed.insert(track.ids[i]).second) {
+            order.push_back(track.ids[i]);
+        }
+    }
+    return order;
+}
+
+static void replay_read_sector(void *ctx, const track_t& track, int phys_sec,
+                               sim_read_t& read) {
+    replay_fdc_t& replay = *(replay_fdc_t *) ctx;
+    const sector_t& sector = track.sectors[phys_sec];
+    replay_track_t& rt = replay_track(replay, track.phys_cyl, track.phys_head);
+    std::map<uint32_t, replay_sector_t>::iterator it
+        = rt.sectors.find(id_key(sector.log_cyl, sector.log_head, sector.log_sector));
+    if (it == rt.sectors.end() || it->second.reads.empty()) {
+        // There's no telling what's in it.
+        read.missing = true;
+        replay.num_unknown++;
+        return;
+    }
+
+    replay_sector_t& rs = it->second;
+    if (rs.next == rs.reads.size()) {
+        rs.next = 0;
+        replay.num_reused++;
+    }
+    const replay_read_t& r = rs.reads[rs.next++];
+    read.missing = r.missing;
+    read.crc_error = r.crc_error;
+    read.data = r.missing ? NULL : &r.data[0];
+    read.crc = rs.crc;
+}
+
+// Work out from the trace what's on the disk, and start a simulated drive
+// with that disk in it.
+static void open_model(replay_fdc_t& replay, double rev_time) {
+    // The IDs on each track, from READ IDs, and the order they're in from
+    // READ IDs that followed each other...
+    replay_track_t *last_track = NULL;
+    uint32_t last_id = 0;
+    for (size_t i = 0; i < replay.cmds.size(); i++) {
+        struct floppy_raw_cmd cmd;
+        int saved_errno;
+        double duration;
+        const uint8_t *data;
+        const int rc = get_recorded_cmd(replay, replay.cmds[i], cmd, &saved_errno,
+                                        &duration, &data);
+        const int op = cmd.cmd[0] & 0x1F;
+        const int mode = cmd_mode(cmd);
+        if (rc < 0 || mode == -1 || cmd.reply_count < 7
+            || (op != 0x0A && op != 0x06 && op != 0x0C)) {
+            last_track = NULL;
+            continue;
+        }
+
+        replay_track_t& track = replay_track(replay, cmd.track, (cmd.cmd[1] >> 2) & 1);
+        track.modes_tried |= 1u << mode;
+        if (op != 0x0A || ((cmd.reply[0] >> 6) & 3) != 0) {
+            last_track = NULL;
+            continue;
+        }
+
+        const uint32_t id = id_key(cmd.reply[3], cmd.reply[4], cmd.reply[5]);
+        track.mode = mode;
+        track.size_code = cmd.reply[6];
+        replay_sector(track, id, false);
+        if (last_track == &track) {
+            track.next_ids[last_id][id]++;
+        }
+        last_track = &track;
+        last_id = id;
+    }
+
+    // ... then what each read of the sectors' data got.
+    for (size_t i = 0; i < replay.cmds.size(); i++) {
+        const replay_cmd_t& rec = replay.cmds[i];
+        struct floppy_raw_cmd cmd;
+        int saved_errno;
+        double duration;
+        const uint8_t *data;
+        const int rc = get_recorded_cmd(replay, rec, cmd, &saved_errno,
+                                        &duration, &data);
+        const int op = cmd.cmd[0] & 0x1F;
+        if (rc < 0 || cmd_mode(cmd) == -1 || cmd.reply_count < 7
+            || (op != 0x06 && op != 0x0C)) {
+            continue;
+        }
+        note_data_read(replay, cmd, data, data_read(cmd, rec.length, rc));
+    }
+
+    disk_t disk;
+    init_disk(disk);
+    for (std::map<int, replay_track_t>::iterator it = replay.tracks.begin();
+         it != replay.tracks.end(); ++it) {
+        replay_track_t& rt = it->second;
+        if (rt.mode == -1) continue;
+
+        track_t& track = disk_track(disk, it->first / 2, it->first % 2);
+        track.status = TRACK_PROBED;
+        track.data_mode = &DATA_MODES[rt.mode];
+        track.sector_size_code = rt.size_code;
+        const std::vector<uint32_t> order = id_order(rt);
+        resize_track(track, order.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            sector_t& sector = track.sectors[i];
+            replay_sector_t& rs = rt.sectors[order[i]];
+            sector.log_cyl = order[i] >> 16;
+            sector.log_head = (order[i] >> 8) & 0xFF;
+            sector.log_sector = order[i] & 0xFF;
+            sector.deleted = rs.deleted;
+
+            // If the CRC after the data wasn't read, make up one that
+            // matches the data of a good read (or doesn't match a bad one).
+            for (size_t j = 0; j < rs.reads.size() && !rs.has_crc; j++) {
+                const replay_read_t& read = rs.reads[j];
+                if (!read.missing && !read.crc_error) {
+                    rs.crc = data_field_crc(track.data_mode->is_fm, rs.deleted,
+                                            &read.data[0], read.data.size());
+                    rs.has_crc = true;
+                }
+            }
+            for (size_t j = 0; j < rs.reads.size() && !rs.has_crc; j++) {
+                const replay_read_t& read = rs.reads[j];
+                if (!read.missing) {
+                    rs.crc = data_field_crc(track.data_mode->is_fm, rs.deleted,
+                                            &read.data[0], read.data.size()) ^ 0xFFFF;
+                    rs.has_crc = true;
+                }
+            }
+        }
+    }
+
+    open_sim_disk_fdc(disk, replay.drive_tracks, rev_time,
+                      replay_read_sector, &replay, replay.model);
+    free_disk(disk);
+}
+
+// Check that a command is about a track the trace says something about --
+// either some sectors were found on it, or it was tried in the same mode
+// and nothing was found.
+static void check_modelled(const replay_fdc_t& replay,
+                           const struct floppy_raw_cmd& cmd) {
+    const int op = cmd.cmd[0] & 0x1F;
+    if (op != 0x0A && op != 0x06 && op != 0x0C) return;
+
+    const int head = (cmd.cmd[1] >> 2) & 1;
+    const int mode = cmd_mode(cmd);
+    std::map<int, replay_track_t>::const_iterator it
+        = replay.tracks.find(cmd.track * 2 + head);
+    if (it != replay.tracks.end()
+        && (it->second.mode != -1
+            || (mode != -1 && (it->second.modes_tried & (1u << mode)) != 0))) {
+        return;
+    }
+    die("Track %d head %d isn't read in %s in the trace", cmd.track, head,
+        mode == -1 ? "this mode" : DATA_MODES[mode].name);
+}
+
+static int replay_raw_cmd(fdc_t& fdc, struct floppy_raw_cmd& cmd) {
+    replay_fdc_t& replay = *(replay_fdc_t *) fdc.state;
+
+    if (!replay.modelling && replay.next_cmd < replay.cmds.size()) {
+        const replay_cmd_t& rec = replay.cmds[replay.next_cmd];
+        replay.buf.clear();
+        put_command(replay.buf, cmd);
+        if (replay.buf.size() == rec.key_length
+            && memcmp(&replay.buf[0], &replay.trace[rec.key], rec.key_length) == 0) {
+            replay.next_cmd++;
+            replay.num_cmds++;
+
+            int saved_errno;
+            double duration;
+            const uint8_t *data;
+            uint8_t *buf = (uint8_t *) cmd.data;
+            const int rc = get_recorded_cmd(replay, rec, cmd, &saved_errno,
+                                            &duration, &data);
+            memcpy(buf, data, data_read(cmd, rec.length, rc));
+            fdc.busy_time += duration;
+            errno = saved_errno;
+            return rc;
+        }
+    }
+
+    if (!replay.modelling) {
+        open_model(replay, fdc.rev_time);
+        replay.modelling = true;
+    }
+    check_modelled(replay, cmd);
+    replay.num_modelled++;
+    const double start = replay.model.busy_time;
+    const int rc = replay.model.raw_cmd(replay.model, cmd);
+    fdc.busy_time += replay.model.busy_time - start;
+    return rc;
+}
+
+static int replay_drive_tracks(fdc_t& fdc) {
+    replay_fdc_t& replay = *(replay_fdc_t *) fdc.state;
+    return replay.drive_tracks;
+}
+
+static void replay_reset(fdc_t& fdc) {
+    (void) fdc;
+}
+
+static void replay_close(fdc_t& fdc) {
+    replay_fdc_t *replay = (replay_fdc_t *) fdc.state;
+    fprintf(replay->out, "Replayed %zd commands", replay->num_cmds);
+    if (replay->num_modelled > 0) {
+        fprintf(replay->out, ", and simulated %zd from the disk in the trace", replay->num_modelled);
+    }
+    if (replay->num_reused > 0) {
+        fprintf(replay->out, ", reusing recorded reads %zd times", replay->num_reused);
+    }
+    fprintf(replay->out, "\n");
+    if (replay->num_unknown > 0) {
+        fprintf(replay->out, "%zd reads were of sectors never read in the trace, so they got no data\n",
+                replay->num_unknown);
+    }
+    if (replay->modelling) {
+        close_fdc(replay->model);
+    }
+    delete replay;
+}
+
+void open_replay_fdc(const char *filename, FILE *out, fdc_t& fdc) {
+    replay_fdc_t *replay = new replay_fdc_t;
+    std::vector<uint8_t>& trace = replay->trace;
+    if (!read_whole_file(filename, trace)) {
+        die_errno("cannot open %s", filename);
+    }
+    replay->out = out;
+    fprintf(out, "replaying %s\n", filename);
+
+    if (trace.size() < TRACE_HEADER_LEN
+        || memcmp(&trace[0], TRACE_MAGIC, TRACE_MAGIC_LEN) != 0) {
+        die("%s isn't a trace file", filename);
+    }
+    fdc.rev_time = get_be64(&trace[TRACE_MAGIC_LEN]) * 1e-9;
+    replay->drive_tracks = -1;
+    replay->next_cmd = 0;
+    replay->modelling = false;
+    replay->num_cmds = 0;
+    replay->num_modelled = 0;
+    replay->num_reused = 0;
+    replay->num_unknown = 0;
+
+    // Index the commands. A record cut short (if dumpfloppy was killed
+    // while recording) ends the trace.
+    size_t pos = TRACE_HEADER_LEN;
+    while (pos < trace.size()) {
+        const uint8_t *p = &trace[pos];
+        const size_t avail = trace.size() - pos;
+
+        if (p[0] == RECORD_TRACKS) {
+            if (avail < 5) break;
+            if (replay->drive_tracks == -1) {
+                replay->drive_tracks = get_be32(p + 1);
+            }
+            pos += 5;
+        } else if (p[0] == RECORD_RESET) {
+            pos += 1;
+        } else if (p[0] == RECORD_CMD) {
+            if (avail < 8) break;
+            if (p[7] > FD_RAW_CMD_SIZE) {
+                die("%s has a bad record at offset %zd", filename, pos);
+            }
+            replay_cmd_t rec;
+            rec.key = pos + 1;
+            rec.key_length = 7 + p[7] + 4;
+            if (avail < 1 + rec.key_length) break;
+            rec.offset = rec.key + rec.key_length;
+            rec.length = (long) get_be32(p + rec.key_length - 3);
+            const size_t len = result_length(*replay, rec.offset, rec.length);
+            if (len == 0) break;
+            if (trace[rec.offset + 12] > FD_RAW_REPLY_SIZE) {
+                die("%s has a bad record at offset %zd", filename, pos);
+            }
+
+            replay->cmds.push_back(rec);
+            pos = rec.offset + len;
+        } else {
+            die("%s has a bad record at offset %zd", filename, pos);
+        }
+    }
+    if (replay->drive_tracks == -1) {
+        die("%s doesn't say how many tracks the drive has", filename);
+    }
+
+    fdc.raw_cmd = replay_raw_cmd;
+    fdc.drive_tracks = replay_drive_tracks;
+    fdc.reset = replay_reset;
+    fdc.close = replay_close;
+    fdc.state = replay;
+    fdc.busy_time = 0.0;
+}
@@ -0,0 +1,201 @@
+/*
+    flat.cpp: convert sectors to a flat image file
+
+    Copyright (C) 2013 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include "disk.h"
+#include "flat.h"
+#include "util.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+static void update_range(int value, range& r) {
+    if (value < r.start) {
+        r.start = value;
+    }
+    if (value >= r.end) {
+        r.end = value + 1;
+    }
+}
+
+static void apply_range_option(const range& in, range& out) {
+    if (in.start != -1) {
+        out.start = in.start;
+    }
+    if (in.end != -1) {
+        out.end = in.end;
+    }
+}
+
+void init_flat_options(flat_options_t& options) {
+    options.in_cyls.start = 0;
+    options.in_cyls.end = MAX_CYLS;
+    options.in_heads.start = 0;
+    options.in_heads.end = MAX_HEADS;
+    options.in_sectors.start = 0;
+    options.in_sectors.end = MAX_SECS; // XXX logical sectors?
+    options.out_cyls.start = options.out_cyls.end = -1;
+    options.out_heads.start = options.out_heads.end = -1;
+    options.out_sectors.start = options.out_sectors.end = -1;
+    options.permissive = false;
+    options.ask_variant = true;
+    options.vote = false;
+}
+
+void init_flat(flat_image_t& flat_image, const flat_options_t& options) {
+    flat_image.options = options;
+    flat_image.disk_image.clear();
+    flat_image.out_cyls.start = MAX_CYLS;
+    flat_image.out_cyls.end = 0;
+    flat_image.out_heads.start = MAX_HEADS;
+    flat_image.out_heads.end = 0;
+    flat_image.out_sectors.start = MAX_SECS;
+    flat_image.out_sectors.end = 0;
+    flat_image.size_code = -1;
+    flat_image.did_bell = false;
+}
+
+void add_flat_track(flat_image_t& flat_image, const track_t& track) {
+    const flat_options_t& args = flat_image.options;
+    disk_image_t& disk_image = flat_image.disk_image;
+    const int phys_cyl = track.phys_cyl;
+    const int phys_head = track.phys_head;
+
+    if (phys_cyl < args.in_cyls.start || phys_cyl >= args.in_cyls.end) return;
+    if (phys_head < args.in_heads.start || phys_head >= args.in_heads.end) return;
+
+    // For each real sector, add a lump.
+    for (int phys_sec = 0; phys_sec < track.num_sectors; phys_sec++) {
+        const sector_t& sector = track.sectors[phys_sec];
+
+        // Use physical cyl and head, but logical sector.
+        // FIXME: Option to choose physical/logical values
+        int cyl = phys_cyl;
+        int head = phys_head;
+        int sec = sector.log_sector;
+
+        if (sec < args.in_sectors.start || sec >= args.in_sectors.end) {
+            continue;
+        }
+
+        update_range(cyl, flat_image.out_cyls);
+        update_range(head, flat_image.out_heads);
+        update_range(sec, flat_image.out_sectors);
+
+        // FIXME: Option to include/exclude bad/deleted sectors
+        if (sector.status == SECTOR_MISSING) continue;
+
+        SHC_t SHC(cyl, head, sec);
+        if (disk_image.find(SHC) != disk_image.end() && !args.permissive) {
+            die("Two sectors found for cylinder %d head %d sector %d", cyl, head, sec);
+        }
+
+        size_t data_id = 0;
+        if (sector.datas.size() != 1) {
+            // Find the highest read count for the default option.
+            for (size_t i = 0; i < sector.datas.size(); i++) {
+                if (sector.datas[i].count > sector.datas[data_id].count) {
+                    data_id = i;
+                }
+            }
+        }
+        if (sector.datas.size() != 1 && args.ask_variant && !args.vote) {
+            if (!flat_image.did_bell) {
+                fprintf(stderr, "\x07");
+                flat_image.did_bell = true;
+            }
+            fprintf(stderr, "Enter the 'IMD data id' to use for Logical C %d H %d S %d: [default: %zd, count: %d]: ",
+                sector.log_cyl, sector.log_head, sector.log_sector,
+                data_id, sector.datas[data_id].count
+            );
+            char buf[100];
+            for (;;) {
+                if (fgets(buf, sizeof(buf), stdin) == NULL) {
+                    die_errno("Error reading stdin");
+                }
+                //fprintf(stderr, "Read %s\n", buf);
+                if (strcmp(buf, "\n") == 0) {
+                    fprintf(stderr, "Using default ID of %zd\n", data_id);
+                    break;
+                } else if (sscanf(buf, "%zd", &data_id) == 1) {
+                    if (data_id < sector.datas.size()) {
+                        break;
+                    } else {
+                        fprintf(stderr, "Parsed invalid 'IMD data id': %zd. Must be less than %zd.\n: ", data_id, sector.datas.size());
+                    }
+                } else {
+                    fprintf(stderr, "Error parsing 'IMD data id': (%d:%s)\n: ", errno, strerror(errno));
+                }
+            }
+        }
+        assert(sector.datas[data_id].length() == sector_bytes(track.sector_size_code));
+        if (sector.datas.size() != 1 && args.vote && sector.status == SECTOR_BAD) {
+            std::vector<bool> uncertain;
+            const size_t num_uncertain = vote_sector_data(sector, disk_image[SHC], uncertain);
+            uint64_t reads = 0;
+            for (size_t i = 0; i < sector.datas.size(); i++) {
+                reads += sector.datas[i].count;
+            }
+            fprintf(stderr, "Voted on %zd versions from %llu reads for Logical C %d H %d S %d: %zd bytes uncertain\n",
+                sector.datas.size(), (unsigned long long) reads,
+                sector.log_cyl, sector.log_head, sector.log_sector, num_uncertain);
+        } else {
+            disk_image[SHC].assign(sector.datas[data_id].data(), sector.datas[data_id].length());
+        }
+
+        // Sanity check that all the sectors are the same size. TODO: Is it really a problem if some are different sizes?
+        if (flat_image.size_code == -1) {
+            flat_image.size_code = track.sector_size_code;
+        } else if (track.sector_size_code != flat_image.size_code) {
+            printf("Tracks have inconsistent sector sizes: %d != %d for %d,%d,%d (total sectors per track: %d)\n",
+                track.sector_size_code, flat_image.size_code, cyl, head, sec, track.num_sectors);
+        }
+    }
+}
+
+void write_flat(const flat_image_t& flat_image, FILE *flat) {
+    const flat_options_t& args = flat_image.options;
+    range out_cyls = flat_image.out_cyls;
+    range out_heads = flat_image.out_heads;
+    range out_sectors = flat_image.out_sectors;
+    const int size_code = flat_image.size_code;
+
+    // Override output ranges as specified in options.
+    apply_range_option(args.out_cyls, out_cyls);
+    apply_range_option(args.out_heads, out_heads);
+    apply_range_option(args.out_sectors, out_sectors);
+
+    data_t dummy_data(sector_bytes(size_code), 0xFF); // Data to write where we don't have a real sector.
+
+    // Go through the disk_image, and write all sectors out.
+    for_range (cyl, out_cyls) {
+        for_range (head, out_heads) {
+            for_range (sec, out_sectors) {
+                // For each sector that *should* exist, add a dummy lump.
+                disk_image_t::const_iterator sec_data_it = flat_image.disk_image.find(SHC_t(cyl, head, sec));
+                fwrite(
+                    sec_data_it == flat_image.disk_image.end() ? dummy_data.data() : sec_data_it->second.data(),
+                    1, sector_bytes(size_code), flat
+                );
+            }
+        }
+    }
+}
+
@@ -0,0 +1,86 @@
+/*
+    flat.h: convert sectors to a flat image file
+
+    Copyright (C) 2013 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#ifndef FLAT_H
+#define FLAT_H
+
+#include "disk.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include <map>
+
+typedef struct {
+    int start;
+    int end;
+} range;
+
+#define for_range(var, range) \
+    for(int var = (range).start; var < (range).end; var++)
+
+
+class SHC_t {
+public:
+    int cyl;
+    int head;
+    int sec;
+    SHC_t(int c, int h, int s) : cyl(c), head(h), sec(s) {}
+    bool operator <(const SHC_t& rhs) const {
+        if (this->cyl  < rhs.cyl)  return true;
+        if (this->cyl  > rhs.cyl)  return false;
+        if (this->head < rhs.head) return true;
+        if (this->head > rhs.head) return false;
+        return this->sec < rhs.sec;
+    }
+};
+
+// Which sectors to put in a flat file, and where.
+typedef struct {
+    range in_cyls, in_heads, in_sectors;
+    // The range of C/H/S in the flat file; -1 means to use what's found.
+    range out_cyls, out_heads, out_sectors;
+    bool permissive; // Ignore duplicated input sectors
+    bool ask_variant; // Ask which data to use when a sector has several
+    bool vote; // Or reconstruct it from all of them by vote_sector_data
+} flat_options_t;
+
+void init_flat_options(flat_options_t& options);
+
+// The sectors chosen so far for the flat file, and the range of C/H/S to
+// use in it (based on what we load).
+typedef std::map<SHC_t, data_t> disk_image_t;
+typedef struct {
+    flat_options_t options;
+    disk_image_t disk_image;
+    range out_cyls, out_heads, out_sectors;
+    int size_code;
+    bool did_bell;
+} flat_image_t;
+
+void init_flat(flat_image_t& flat_image, const flat_options_t& options);
+
+// Add the sectors from a track to the flat file, if it's in the input range.
+void add_flat_track(flat_image_t& flat_image, const track_t& track);
+
+// Write out the flat file, once all the tracks have been added.
+void write_flat(const flat_image_t& flat_image, FILE *flat);
+
+#endif
@@ -22,14 +22,21 @@
 
 #include "disk.h"
 #include "imd.h"
+#include "kernels.h"
 #include "util.h"
 
 #include <arpa/inet.h>
 #include <assert.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
+
+#include <vector>
 
 #define IMD_END_OF_COMMENT 0x1A
 
@@ -46,55 +53,127 @@
 #define IMD_SDR_ANOTHER_DATA_FOLLOWS 0x08 // Extension to original .IMD file format.
 #define IMD_SDR_HAS_DATA_COUNT 0x10       // Extension to original .IMD file format.
 
-// Read a track and add it to the disk. Return false on EOF.
-static bool read_imd_track(FILE *image, disk_t& disk) {
-    uint8_t header[5];
-    int count = fread(header, 1, 5, image);
-    if (count == 0 && feof(image)) {
-        return false;
+// Return whether there's nothing more to read.
+static bool reader_at_end(imd_reader_t& reader) {
+    if (reader.file == NULL) {
+        return reader.pos == reader.end;
+    }
+
+    int c = getc(reader.file);
+    if (c == EOF) {
+        return true;
     }
-    if (count != 5) {
-        die("Couldn't read IMD track header");
+    ungetc(c, reader.file);
+    return false;
+}
+
+// Read len bytes, returning NULL if there aren't enough left.
+// When reading from a stream, the data is only valid until the next read.
+static const uint8_t *reader_read(imd_reader_t& reader, size_t len) {
+    if (reader.file == NULL) {
+        if (size_t(reader.end - reader.pos) < len) {
+            return NULL;
+        }
+        const uint8_t *data = reader.pos;
+        reader.pos += len;
+        return data;
     }
 
-    int phys_cyl = header[1];
-    if (phys_cyl >= MAX_CYLS) {
-        die("IMD track cylinder value too large: %d", phys_cyl);
+    if (reader.buf.size() < len) {
+        reader.buf.resize(len);
     }
-    if (phys_cyl >= disk.num_phys_cyls) {
-        disk.num_phys_cyls = phys_cyl + 1;
+    if (fread(&reader.buf[0], 1, len, reader.file) != len) {
+        return NULL;
     }
+    return &reader.buf[0];
+}
+
+// Read a fixed-size part of a track header.
+static void read_imd_map(imd_reader_t& reader, uint8_t *map, size_t len,
+                         const char *what) {
+    const uint8_t *data = reader_read(reader, len);
+    if (data == NULL) {
+        die("Couldn't read IMD %s", what);
+    }
+    memcpy(map, data, len);
+}
+
+static void read_imd_comment(imd_reader_t& reader) {
+    if (reader.file == NULL) {
+        const uint8_t *comment_end = (const uint8_t *) memchr(reader.pos, IMD_END_OF_COMMENT, reader.end - reader.pos);
+        if (comment_end == NULL) {
+            die("Couldn't find IMD comment delimiter");
+        }
+        reader.comment = std::string((const char *) reader.pos, comment_end - reader.pos);
+        reader.pos = comment_end + 1;
+        return;
+    }
+
+    char* read_buf = NULL;
+    size_t dummy = 0;
+    ssize_t count = getdelim(&read_buf, &dummy, IMD_END_OF_COMMENT, reader.file);
+    if (count < 0 || read_buf[count-1] != IMD_END_OF_COMMENT) {
+        die("Couldn't find IMD comment delimiter");
+    }
+    reader.comment = std::string(read_buf, count-1);
+    free(read_buf); // free in accordance with getdelim spec
+}
+
+// Read the next comment, or the header of the next track.
+static imd_item_t read_imd_header(imd_reader_t& reader, uint8_t header[5]) {
+    if (reader_at_end(reader)) {
+        if (!reader.started) {
+            die("Couldn't find IMD comment delimiter");
+        }
+        return IMD_END;
+    }
+
+    // A track starts with its mode, so printable text must be the comment at
+    // the start of another image.
+    int c;
+    if (reader.file == NULL) {
+        c = *reader.pos;
+    } else {
+        c = getc(reader.file);
+        ungetc(c, reader.file);
+    }
+    if (!reader.started || (find_data_mode(c) == NULL && c >= ' ')) {
+        read_imd_comment(reader);
+        reader.started = true;
+        return IMD_COMMENT;
+    }
+    if (find_data_mode(c) == NULL) {
+        die("IMD track mode unknown: %d", c);
+    }
+
+    read_imd_map(reader, header, 5, "track header");
 
     if ((header[2] & ~IMD_ALL_FLAGS) != 0) {
         die("IMD track has unsupported flags: %02x", header[2]);
     }
-
     int phys_head = header[2] & IMD_HEAD_MASK;
     if (phys_head >= MAX_HEADS) {
         die("IMD track head value too large: %d", phys_head);
     }
-    if (phys_head >= disk.num_phys_heads) {
-        disk.num_phys_heads = phys_head + 1;
-    }
+    return IMD_TRACK;
+}
+
+// Read the rest of a track, given its header.
+static void read_imd_track(imd_reader_t& reader, const uint8_t header[5],
+                           track_t& track) {
+    int phys_cyl = header[1];
+    int phys_head = header[2] & IMD_HEAD_MASK;
 
-    track_t& track = disk.tracks[phys_cyl][phys_head];
     track.status = TRACK_PROBED;
-    for (int i = 0; ; i++) {
-        if (DATA_MODES[i].name == NULL) {
-            die("IMD track mode unknown: %d", header[0]);
-        }
-        if (DATA_MODES[i].imd_mode == header[0]) {
-            track.data_mode = &DATA_MODES[i];
-            break;
-        }
-    }
+    track.data_mode = find_data_mode(header[0]);
+    assert(track.data_mode != NULL);
     track.phys_cyl = phys_cyl;
     track.phys_head = phys_head;
     size_t num_sectors = header[3];
-    track.num_sectors = num_sectors;
+    resize_track(track, num_sectors);
     track.sector_size_code = header[4];
     if (track.num_sectors == 0) {
-        return true; // Nothing else to do. (Note: a completely unreadable track will have no sectors and sector_size_code 0xFF.)
+        return; // Nothing else to do. (Note: a completely unreadable track will have no sectors and sector_size_code 0xFF.)
     }
     if (track.sector_size_code == 0xFF) {
         // FIXME: implement this (by having arbitrary sector sizes)
@@ -106,27 +185,27 @@ static bool read_imd_track(FILE *image, disk_t& disk) {
     uint8_t cyl_map[num_sectors];
     uint8_t head_map[num_sectors];
 
-    if (fread(sec_map, 1, num_sectors, image) != num_sectors) {
-        die("Couldn't read IMD sector map");
-    }
+    read_imd_map(reader, sec_map, num_sectors, "sector map");
     if (header[2] & IMD_NEED_CYL_MAP) {
-        if (fread(cyl_map, 1, num_sectors, image) != num_sectors) {
-            die("Couldn't read IMD cylinder map");
-        }
+        read_imd_map(reader, cyl_map, num_sectors, "cylinder map");
     } else {
         memset(cyl_map, phys_cyl, num_sectors);
     }
     if (header[2] & IMD_NEED_HEAD_MAP) {
-        if (fread(head_map, 1, num_sectors, image) != num_sectors) {
-            die("Couldn't read IMD head map");
-        }
+        read_imd_map(reader, head_map, num_sectors, "head map");
     } else {
         memset(head_map, phys_head, num_sectors);
     }
 
+    if (reader.sector_offsets != NULL) {
+        reader.sector_offsets->clear();
+    }
     for (size_t phys_sec = 0; phys_sec < num_sectors; phys_sec++) {
         sector_t& sector = track.sectors[phys_sec];
 
+        if (reader.sector_offsets != NULL) {
+            reader.sector_offsets->push_back(imd_reader_offset(reader));
+        }
         assert(sector.status == SECTOR_MISSING);
         sector.log_cyl = cyl_map[phys_sec];
         sector.log_head = head_map[phys_sec];
@@ -140,10 +219,11 @@ static bool read_imd_track(FILE *image, disk_t& disk) {
             have_data_to_read = false; // By default we only have one sector type to read.
             uint8_t type, orig_type;
             uint32_t count = 1;
-            if (fread(&type, 1, 1, image) != 1) {
+            const uint8_t *type_data = reader_read(reader, 1);
+            if (type_data == NULL) {
                 die("Couldn't read IMD sector header");
             }
-            orig_type = type;
+            type = orig_type = *type_data;
 
             if (type > 0) {
                 //printf("%s:%d got type %08x for (%d.%d.%d)\n", __FILE__, __LINE__, type, sector.log_cyl, sector.log_head, sector.log_sector);
@@ -151,9 +231,11 @@ static bool read_imd_track(FILE *image, disk_t& disk) {
 
                 if (type >= IMD_SDR_HAS_DATA_COUNT) {
                     type -= IMD_SDR_HAS_DATA_COUNT;
-                    if (fread(&count, sizeof(count), 1, image) != 1) {
-                        die_errno("Couldn't read IMD data count");
+                    const uint8_t *count_data = reader_read(reader, sizeof(count));
+                    if (count_data == NULL) {
+                        die("Couldn't read IMD data count");
                     }
+                    memcpy(&count, count_data, sizeof(count));
                     count = ntohl(count);
                     assert(count > 1);
                 }
@@ -183,25 +265,32 @@ static bool read_imd_track(FILE *image, disk_t& disk) {
                     assert(type < IMD_SDR_IS_DELETED);
                 }
 
-                data_t this_data;
+                // Sector data that's mapped, or that can be shared with other
+                // sectors, is used in place rather than copied.
+                const uint8_t *data;
+                bool can_view = (reader.file == NULL);
                 if (type >= IMD_SDR_IS_COMPRESSED) {
                     type -= IMD_SDR_IS_COMPRESSED;
-                    uint8_t fill;
-                    if (fread(&fill, 1, 1, image) != 1) {
+                    const uint8_t *fill = reader_read(reader, 1);
+                    if (fill == NULL) {
                         die("Couldn't read IMD compressed sector data");
                     }
-                    this_data.assign(sector_size, fill);
+                    data = get_fill_block(reader.fill_blocks, *fill, sector_size);
+                    can_view = true;
                 } else {
-                    uint8_t data_buf[sector_size];
-                    if (fread(data_buf, 1, sector_size, image) != sector_size) {
+                    data = reader_read(reader, sector_size);
+                    if (data == NULL) {
                         die("Couldn't read IMD sector data");
                     }
-                    this_data.assign(data_buf, sector_size);
                 }
-                std::pair<data_map_t::iterator, bool> ret = sector.datas.insert(data_map_t::value_type(this_data, count));
-                if (!ret.second) {
+                if (sector.datas.find(data, sector_size) != NULL) {
                     die("unexpected duplicate data");
                 }
+                if (can_view) {
+                    sector.datas.insert_view(data, sector_size, count);
+                } else {
+                    sector.datas.insert(data, sector_size, count);
+                }
 
                 if (type != 0) {
                     die("IMD sector has unsupported flags: %08x", orig_type);
@@ -210,44 +299,223 @@ static bool read_imd_track(FILE *image, disk_t& disk) {
             first_read = false;
         }
     }
+}
 
-    return true;
+static void init_imd_reader(imd_reader_t& reader) {
+    reader.file = NULL;
+    reader.own_file = false;
+    reader.buf.clear();
+    reader.mapped = NULL;
+    reader.mapped_size = 0;
+    reader.pos = reader.end = reader.dropped = NULL;
+    reader.fill_blocks.clear();
+    reader.comment = "";
+    reader.started = false;
+    reader.sector_offsets = NULL;
 }
 
-void read_imd(FILE *image, disk_t& disk) {
-    init_disk(disk);
+void open_imd_reader(FILE *image, imd_reader_t& reader) {
+    init_imd_reader(reader);
+    reader.file = image;
+}
 
-    // Read the comment.
-    char* read_buf;
-    size_t dummy = 0;
-    ssize_t count = getdelim(&read_buf, &dummy, IMD_END_OF_COMMENT, image);
-    if (count < 0 || read_buf[count-1] != IMD_END_OF_COMMENT) {
-        die("Couldn't find IMD comment delimiter");
+void open_imd_file(const char *filename, imd_reader_t& reader) {
+    init_imd_reader(reader);
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        die_errno("cannot open %s", filename);
     }
-    disk.comment = std::string(read_buf, count-1);
-    free(read_buf); // free in accordance with getdelim spec
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        die_errno("stat failed on %s", filename);
+    }
+
+    void *mapped = MAP_FAILED;
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if (mapped == MAP_FAILED) {
+        // Not something we can map (e.g. a pipe) -- read it instead.
+        reader.file = fdopen(fd, "rb");
+        if (reader.file == NULL) {
+            die_errno("cannot open %s", filename);
+        }
+        reader.own_file = true;
+        return;
+    }
+    close(fd);
+    madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+
+    reader.mapped = mapped;
+    reader.mapped_size = st.st_size;
+    reader.pos = reader.dropped = (const uint8_t *) mapped;
+    reader.end = reader.pos + st.st_size;
+}
+
+void close_imd_reader(imd_reader_t& reader) {
+    if (reader.own_file) {
+        fclose(reader.file);
+    }
+    if (reader.mapped != NULL) {
+        munmap(reader.mapped, reader.mapped_size);
+    }
+    init_imd_reader(reader);
+}
+
+imd_item_t read_imd_next(imd_reader_t& reader, track_t& track) {
+    // Once we've moved past some mapped pages, let the OS drop them, so that
+    // streaming through a large file doesn't keep it all resident. (Views of
+    // the dropped pages are still valid; they'll just be read in again if
+    // they're used.)
+    if (reader.file == NULL) {
+        const long page_size = sysconf(_SC_PAGESIZE);
+        const uint8_t *start = (const uint8_t *) reader.mapped;
+        const uint8_t *drop_to = start + ((reader.pos - start) / page_size) * page_size;
+        if (drop_to > reader.dropped) {
+            madvise((void *) reader.dropped, drop_to - reader.dropped, MADV_DONTNEED);
+            reader.dropped = drop_to;
+        }
+    }
+
+    uint8_t header[5];
+    imd_item_t item = read_imd_header(reader, header);
+    if (item == IMD_TRACK) {
+        init_track(header[1], header[2] & IMD_HEAD_MASK, track);
+        read_imd_track(reader, header, track);
+    }
+    return item;
+}
 
+uint64_t imd_reader_offset(imd_reader_t& reader) {
+    if (reader.file == NULL) {
+        return reader.pos - (const uint8_t *) reader.mapped;
+    }
+    long offset = ftell(reader.file);
+    if (offset < 0) {
+        die_errno("cannot get position in IMD file");
+    }
+    return offset;
+}
+
+void seek_imd_reader(imd_reader_t& reader, uint64_t offset) {
+    if (reader.file == NULL) {
+        if (offset > reader.mapped_size) {
+            die("IMD seek beyond end of file");
+        }
+        reader.pos = (const uint8_t *) reader.mapped + offset;
+    } else if (fseek(reader.file, offset, SEEK_SET) != 0) {
+        die_errno("cannot seek in IMD file");
+    }
+    // We must be past the comment by now.
+    reader.started = true;
+}
+
+// Read a complete image into a disk.
+static void read_imd_disk(imd_reader_t& reader, disk_t& disk) {
+    uint8_t header[5];
+    read_imd_header(reader, header);
+    disk.comment = reader.comment;
     disk.num_phys_cyls = 0;
     disk.num_phys_heads = 0;
 
-    while (read_imd_track(image, disk)) {
-        // Nothing.
+    while (true) {
+        imd_item_t item = read_imd_header(reader, header);
+        if (item == IMD_END) break;
+        if (item == IMD_COMMENT) {
+            die("IMD file contains more than one image");
+        }
+
+        int phys_cyl = header[1];
+        if (phys_cyl >= MAX_CYLS) {
+            die("IMD track cylinder value too large: %d", phys_cyl);
+        }
+        if (phys_cyl >= disk.num_phys_cyls) {
+            disk.num_phys_cyls = phys_cyl + 1;
+        }
+        int phys_head = header[2] & IMD_HEAD_MASK;
+        if (phys_head >= disk.num_phys_heads) {
+            disk.num_phys_heads = phys_head + 1;
+        }
+
+        read_imd_track(reader, header, disk_track(disk, phys_cyl, phys_head));
     }
 }
 
+uint64_t hash_image_file(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        die_errno("cannot open %s", filename);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        die_errno("stat failed on %s", filename);
+    }
+
+    uint64_t hash;
+    if (st.st_size == 0) {
+        static const uint8_t nothing = 0;
+        hash = data_hash(&nothing, 0);
+    } else {
+        void *mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            die_errno("cannot map %s", filename);
+        }
+        hash = data_hash((const uint8_t *) mapped, st.st_size);
+        munmap(mapped, st.st_size);
+    }
+    close(fd);
+    return hash;
+}
+
+void read_imd(FILE *image, disk_t& disk) {
+    init_disk(disk);
+
+    imd_reader_t reader;
+    open_imd_reader(image, reader);
+    read_imd_disk(reader, disk);
+
+    // The disk takes over anything its sector data may refer to.
+    disk.fill_blocks.swap(reader.fill_blocks);
+    close_imd_reader(reader);
+}
+
+void map_imd(const char *filename, disk_t& disk) {
+    init_disk(disk);
+
+    imd_reader_t reader;
+    open_imd_file(filename, reader);
+    read_imd_disk(reader, disk);
+
+    // The disk takes over anything its sector data may refer to.
+    disk.mapped = reader.mapped;
+    disk.mapped_size = reader.mapped_size;
+    reader.mapped = NULL;
+    disk.fill_blocks.swap(reader.fill_blocks);
+    close_imd_reader(reader);
+}
+
+void encode_imd_header(const disk_t& disk, std::vector<uint8_t>& buf) {
+    buf.clear();
+    buf.insert(buf.end(), disk.comment.begin(), disk.comment.end());
+    buf.push_back(IMD_END_OF_COMMENT);
+}
+
 void write_imd_header(const disk_t& disk, FILE *image) {
-    if (!disk.comment.empty()) {
-        fwrite(disk.comment.c_str(), 1, disk.comment.length(), image);
+    std::vector<uint8_t> buf;
+    encode_imd_header(disk, buf);
+    if (fwrite(&buf[0], 1, buf.size(), image) != buf.size()) {
+        die_errno("fwrite failed");
     }
-    fputc(IMD_END_OF_COMMENT, image);
 }
 
-void write_imd_track(const track_t& track, FILE *image) {
+size_t encode_imd_track(const track_t& track, std::vector<uint8_t>& buf) {
     uint8_t flags = 0;
 
     uint8_t sec_map[track.num_sectors];
     uint8_t cyl_map[track.num_sectors];
     uint8_t head_map[track.num_sectors];
+    size_t max_size = 5 + 3 * track.num_sectors;
     for (int i = 0; i < track.num_sectors; i++) {
         const sector_t& sector = track.sectors[i];
 
@@ -261,8 +529,18 @@ void write_imd_track(const track_t& track, FILE *image) {
         if (head_map[i] != track.phys_head) {
             flags |= IMD_NEED_HEAD_MAP;
         }
+
+        max_size += 1;
+        for (size_t data_id = 0; data_id < sector.datas.size(); data_id++) {
+            max_size += 1 + sizeof(uint32_t) + sector.datas[data_id].length();
+        }
     }
 
+    // Reserving the most we could need means buf is only reallocated when
+    // it's reused for a bigger track.
+    buf.clear();
+    buf.reserve(max_size);
+
     assert(track.data_mode);
     const uint8_t header[] = {
         track.data_mode->imd_mode,
@@ -271,14 +549,14 @@ void write_imd_track(const track_t& track, FILE *image) {
         track.num_sectors,
         track.sector_size_code,
     };
-    fwrite(header, 1, 5, image);
+    buf.insert(buf.end(), header, header + 5);
 
-    fwrite(sec_map, 1, track.num_sectors, image);
+    buf.insert(buf.end(), sec_map, sec_map + track.num_sectors);
     if (flags & IMD_NEED_CYL_MAP) {
-        fwrite(cyl_map, 1, track.num_sectors, image);
+        buf.insert(buf.end(), cyl_map, cyl_map + track.num_sectors);
     }
     if (flags & IMD_NEED_HEAD_MAP) {
-        fwrite(head_map, 1, track.num_sectors, image);
+        buf.insert(buf.end(), head_map, head_map + track.num_sectors);
     }
 
     for (int i = 0; i < track.num_sectors; i++) {
@@ -303,47 +581,61 @@ void write_imd_track(const track_t& track, FILE *image) {
         }
 
         if (!sector.datas.empty()) {
-            for (data_map_t::const_iterator iter = sector.datas.begin(); iter != sector.datas.end(); iter++) {
-                assert(iter->first.length() == sector_bytes(track.sector_size_code));
+            for (size_t data_id = 0; data_id < sector.datas.size(); data_id++) {
+                const data_variant_t& variant = sector.datas[data_id];
+                assert(variant.length() == sector_bytes(track.sector_size_code));
 
-                if (iter->second > 1) {
+                if (variant.count > 1) {
                     type += IMD_SDR_HAS_DATA_COUNT;
                 }
-                if (std::distance(iter, sector.datas.end()) != 1) {
+                if (data_id + 1 != sector.datas.size()) {
                     type += IMD_SDR_ANOTHER_DATA_FOLLOWS;
                 }
 
                 // If every byte in the sector is identical, just store it once, with a "compressed" flag.
-                const uint8_t first = iter->first[0];
-                bool can_compress = true;
-                type += IMD_SDR_IS_COMPRESSED;
-                for (unsigned int i = 0; i < iter->first.length(); i++) {
-                    if (iter->first[i] != first) {
-                        can_compress = false;
-                        type -= IMD_SDR_IS_COMPRESSED;
-                        break;
-                    }
+                const uint8_t first = variant[0];
+                const bool can_compress = data_is_uniform(variant.data(), variant.length());
+                if (can_compress) {
+                    type += IMD_SDR_IS_COMPRESSED;
                 }
 
                 //printf("%s:%d wrote type %08x for (%d.%d.%d)\n", __FILE__, __LINE__, type, sector.log_cyl, sector.log_head, sector.log_sector);
-                fputc(type, image);
+                buf.push_back(type);
 
-                if (iter->second > 1) {
-                    uint32_t buf = htonl(iter->second);
-                    size_t ret = fwrite(&buf, sizeof(buf), 1, image);
-                    if (ret != 1) { die_errno("fwrite failed"); }
+                if (variant.count > 1) {
+                    uint32_t count = htonl(variant.count);
+                    const uint8_t *count_data = (const uint8_t *) &count;
+                    buf.insert(buf.end(), count_data, count_data + sizeof(count));
                 }
 
                 if (can_compress) {
-                    fputc(first, image);
+                    buf.push_back(first);
                 } else {
-                    fwrite(iter->first.data(), 1, iter->first.length(), image);
+                    buf.insert(buf.end(), variant.data(), variant.data() + variant.length());
                 }
                 type = IMD_SDR_DATA; // Only the first 'type' contains error flags.
             }
         } else {
             //printf("%s:%d wrote type %08x for (%d.%d.%d)\n", __FILE__, __LINE__, type, sector.log_cyl, sector.log_head, sector.log_sector);
-            fputc(type, image);
+            buf.push_back(type);
         }
     }
+
+    return buf.size();
+}
+
+size_t write_imd_track(const track_t& track, FILE *image) {
+    std::vector<uint8_t> buf;
+    const size_t size = encode_imd_track(track, buf);
+    if (fwrite(&buf[0], 1, size, image) != size) {
+        die_errno("fwrite failed");
+    }
+    return size;
+}
+
+size_t write_imd_track_fd(const track_t& track, int fd,
+                          std::vector<uint8_t>& buf) {
+    const size_t size = encode_imd_track(track, buf);
+    write_all(fd, &buf[0], size);
+    return size;
 }
@@ -21,10 +21,88 @@
 #ifndef IMD_H
 #define IMD_H
 
+#include "disk.h"
+
+#include <stdint.h>
 #include <stdio.h>
 
+#include <string>
+#include <vector>
+
+// Reads an image -- or several images concatenated together -- a track at a
+// time, so a whole disk never needs to be held in memory.
+typedef struct {
+    // Either reading from a stdio stream...
+    FILE *file;
+    bool own_file;
+    std::vector<uint8_t> buf; // The last thing read from file.
+    // ... or from a mapped file, in which case sector data can be a view of
+    // the mapping rather than a copy.
+    void *mapped;
+    size_t mapped_size;
+    const uint8_t *pos; // Mapped data not read yet.
+    const uint8_t *end;
+    const uint8_t *dropped; // Mapped data we've told the OS we're done with.
+
+    // Blocks of repeated bytes that sector data may be a view of.
+    fill_blocks_t fill_blocks;
+
+    // The comment of the image currently being read.
+    std::string comment;
+    bool started; // Whether we've read the first comment yet.
+
+    // If not NULL, set to the offset of each sector's data records in the
+    // last track read.
+    std::vector<uint64_t> *sector_offsets;
+} imd_reader_t;
+
+typedef enum {
+    IMD_END = 0,
+    IMD_COMMENT, // The start of an image; its comment is in reader.comment.
+    IMD_TRACK
+} imd_item_t;
+
+// Start reading from a stream, which the caller must close afterwards.
+void open_imd_reader(FILE *image, imd_reader_t& reader);
+// Start reading from a file, mapping it if possible.
+void open_imd_file(const char *filename, imd_reader_t& reader);
+void close_imd_reader(imd_reader_t& reader);
+
+// Read the next comment or track from the input. The first item in an image
+// is always its comment.
+//
+// A track read from a stream is a copy; one read from a mapped file may
+// refer to the mapping, and is only valid until the reader is closed.
+imd_item_t read_imd_next(imd_reader_t& reader, track_t& track);
+
+// Get the offset in the file of the next thing to be read.
+uint64_t imd_reader_offset(imd_reader_t& reader);
+// Move to an offset in the file, which must be the start of a track
+// (usually found from an index -- see imdx.h). This only works for files,
+// not pipes.
+void seek_imd_reader(imd_reader_t& reader, uint64_t offset);
+
+// Compute the data_hash of a whole image file.
+uint64_t hash_image_file(const char *filename);
+
 void read_imd(FILE* image, disk_t& disk);
+// Like read_imd, but map the file into memory, so that sector data is a view
+// of the file rather than a copy. (Falls back to read_imd for files that
+// can't be mapped.)
+void map_imd(const char *filename, disk_t& disk);
+
+// Encode an image's header or a track into buf (replacing its contents).
+// buf can be reused between calls to avoid reallocating it.
+// encode_imd_track returns the encoded size.
+void encode_imd_header(const disk_t& disk, std::vector<uint8_t>& buf);
+size_t encode_imd_track(const track_t& track, std::vector<uint8_t>& buf);
+
+// Write a header or track to an image, returning the size of the track.
 void write_imd_header(const disk_t& disk, FILE* image);
-void write_imd_track(const track_t& track, FILE* image);
+size_t write_imd_track(const track_t& track, FILE* image);
+// Write a track to a file with a single write(), so that if we're
+// interrupted the file ends either before or after the whole track.
+size_t write_imd_track_fd(const track_t& track, int fd,
+                          std::vector<uint8_t>& buf);
 
 #endif
@@ -0,0 +1,267 @@
+/*
+    imdbench: benchmarks for the image-handling code
+
+    Copyright (C) 2013 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "disk.h"
+#include "flat.h"
+#include "imd.h"
+#include "kernels.h"
+#include "show.h"
+#include "synth.h"
+#include "util.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <new>
+#include <string>
+
+// Count allocations, so we can see which operations allocate per sector.
+static uint64_t alloc_count = 0;
+
+void *operator new(size_t size) {
+    alloc_count++;
+    void *p = malloc(size == 0 ? 1 : size);
+    if (p == NULL) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+void operator delete(void *p) noexcept {
+    free(p);
+}
+void operator delete[](void *p) noexcept {
+    free(p);
+}
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+void operator delete[](void *p, size_t) noexcept {
+    free(p);
+}
+
+static struct args {
+    double seconds;
+    const char *kernels;
+    synth_params_t synth;
+} args;
+
+// What the benchmarks work on.
+static struct {
+    disk_t disk;
+    std::string image_filename;
+    size_t image_bytes; // Size of the IMD file
+    size_t data_bytes; // Size of one read of every sector
+    FILE *null;
+} bench;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bench_read_imd(void) {
+    FILE *image = fopen(bench.image_filename.c_str(), "rb");
+    if (image == NULL) {
+        die_errno("cannot open %s", bench.image_filename.c_str());
+    }
+    disk_t disk;
+    read_imd(image, disk);
+    free_disk(disk);
+    fclose(image);
+}
+
+static void bench_map_imd(void) {
+    disk_t disk;
+    map_imd(bench.image_filename.c_str(), disk);
+    free_disk(disk);
+}
+
+static void bench_write_imd_track(void) {
+    write_imd_header(bench.disk, bench.null);
+    for (int cyl = 0; cyl < bench.disk.num_phys_cyls; cyl++) {
+        for (int head = 0; head < bench.disk.num_phys_heads; head++) {
+            write_imd_track(disk_track(bench.disk, cyl, head), bench.null);
+        }
+    }
+}
+
+static void bench_write_flat(void) {
+    flat_options_t options;
+    init_flat_options(options);
+    options.ask_variant = false;
+    flat_image_t flat_image;
+    init_flat(flat_image, options);
+    for (int cyl = 0; cyl < bench.disk.num_phys_cyls; cyl++) {
+        for (int head = 0; head < bench.disk.num_phys_heads; head++) {
+            add_flat_track(flat_image, disk_track(bench.disk, cyl, head));
+        }
+    }
+    write_flat(flat_image, bench.null);
+}
+
+static void bench_show_track_data(void) {
+    for (int cyl = 0; cyl < bench.disk.num_phys_cyls; cyl++) {
+        for (int head = 0; head < bench.disk.num_phys_heads; head++) {
+            show_track_data(disk_track(bench.disk, cyl, head), bench.null);
+        }
+    }
+}
+
+static void bench_init_disk(void) {
+    disk_t disk;
+    init_disk(disk);
+    for (int cyl = 0; cyl < bench.disk.num_phys_cyls; cyl++) {
+        for (int head = 0; head < bench.disk.num_phys_heads; head++) {
+            disk_track(disk, cyl, head);
+        }
+    }
+    free_disk(disk);
+}
+
+// Run a benchmark repeatedly for the requested time, and report on it.
+// bytes is how much data one run processes, or 0 if that isn't meaningful.
+static void run_bench(const char *name, void (*run)(void), size_t bytes) {
+    run(); // Warm up caches.
+
+    const uint64_t start_allocs = alloc_count;
+    const double start = now();
+    long runs = 0;
+    double elapsed;
+    do {
+        run();
+        runs++;
+        elapsed = now() - start;
+    } while (elapsed < args.seconds);
+    const double allocs = double(alloc_count - start_allocs) / runs;
+
+    std::string rate = "-";
+    if (bytes > 0) {
+        rate = str_sprintf("%.1f", (double(bytes) * runs) / elapsed / 1e6);
+    }
+    printf("%-18s %8ld %12.3f %10s %12.1f\n",
+           name, runs, elapsed * 1000.0 / runs, rate.c_str(), allocs);
+    fflush(stdout);
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: imdbench [OPTION]...\n");
+    fprintf(stderr, "  -t SECS    run each benchmark for SECS seconds (default 1)\n");
+    fprintf(stderr, "  -k NAME    use the NAME implementation of the data kernels\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options for the synthetic disk:\n");
+    fputs(SYNTH_USAGE, stderr);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    args.seconds = 1.0;
+    args.kernels = NULL;
+    init_synth_params(args.synth);
+
+    while (true) {
+        int opt = getopt(argc, argv, "t:k:" SYNTH_OPTIONS);
+        if (opt == -1) break;
+
+        switch (opt) {
+        case 't':
+            args.seconds = atof(optarg);
+            break;
+        case 'k':
+            args.kernels = optarg;
+            break;
+        default:
+            if (!parse_synth_option(opt, optarg, args.synth)) {
+                usage();
+            }
+        }
+    }
+    if (optind != argc) {
+        usage();
+    }
+
+    if (args.kernels != NULL && !select_kernels(args.kernels)) {
+        die("Kernels %s not available", args.kernels);
+    }
+
+    make_synth_disk(args.synth, bench.disk);
+
+    // Write the disk out, for the reading benchmarks.
+    const char *tmpdir = getenv("TMPDIR");
+    bench.image_filename = str_sprintf("%s/imdbench.XXXXXX", tmpdir != NULL ? tmpdir : "/tmp");
+    int image_fd = mkstemp(&bench.image_filename[0]);
+    if (image_fd == -1) {
+        die_errno("cannot create %s", bench.image_filename.c_str());
+    }
+    FILE *image = fdopen(image_fd, "wb");
+    write_imd_header(bench.disk, image);
+    bench.image_bytes = 0;
+    for (int cyl = 0; cyl < bench.disk.num_phys_cyls; cyl++) {
+        for (int head = 0; head < bench.disk.num_phys_heads; head++) {
+            write_imd_track(disk_track(bench.disk, cyl, head), image);
+        }
+    }
+    if (fclose(image) != 0) {
+        die_errno("write to %s failed", bench.image_filename.c_str());
+    }
+    struct stat st;
+    if (stat(bench.image_filename.c_str(), &st) != 0) {
+        die_errno("stat failed on %s", bench.image_filename.c_str());
+    }
+    bench.image_bytes = st.st_size;
+    bench.data_bytes = size_t(args.synth.cyls) * args.synth.heads * args.synth.sectors
+                       * sector_bytes(args.synth.size_code);
+
+    bench.null = fopen("/dev/null", "wb");
+    if (bench.null == NULL) {
+        die_errno("cannot open /dev/null");
+    }
+
+    printf("Disk: %dx%dx%dx%zd %s, %.0f%% filled, %.0f%% bad with %d variants\n",
+           args.synth.cyls, args.synth.heads, args.synth.sectors,
+           sector_bytes(args.synth.size_code), args.synth.mode->name,
+           args.synth.fill_fraction * 100.0, args.synth.bad_fraction * 100.0,
+           args.synth.variants);
+    printf("Image: %zd bytes; sector data: %zd bytes; kernels: %s\n\n",
+           bench.image_bytes, bench.data_bytes, kernels().name);
+    printf("%-18s %8s %12s %10s %12s\n",
+           "benchmark", "runs", "ms/run", "MB/s", "allocs/run");
+
+    run_bench("read_imd", bench_read_imd, bench.image_bytes);
+    run_bench("map_imd", bench_map_imd, bench.image_bytes);
+    run_bench("write_imd_track", bench_write_imd_track, bench.image_bytes);
+    run_bench("write_flat", bench_write_flat, bench.data_bytes);
+    run_bench("show_track_data", bench_show_track_data, bench.data_bytes);
+    run_bench("init_disk", bench_init_disk, 0);
+
+    fclose(bench.null);
+    unlink(bench.image_filename.c_str());
+    free_disk(bench.disk);
+    return 0;
+}
@@ -19,7 +19,10 @@
 */
 
 #include "disk.h"
+#include "flat.h"
 #include "imd.h"
+#include "imdx.h"
+#include "journal.h"
 #include "show.h"
 #include "util.h"
 
@@ -27,193 +30,62 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <map>
 
-typedef struct {
-    int start;
-    int end;
-} range;
+#include <algorithm>
+#include <vector>
 
 static struct args {
     const char *image_filename;
     bool show_comment;
     const char *flat_filename;
+    bool build_index;
     bool verbose;
     bool show_data;
-    bool permissive;
-    range in_cyls, in_heads, in_sectors;
-    range out_cyls, out_heads, out_sectors;
+    flat_options_t flat;
 } args;
 
-#define for_range(var, range) \
-    for(int var = (range).start; var < (range).end; var++)
+static flat_image_t flat_image;
 
-static void update_range(int value, range& r) {
-    if (value < r.start) {
-        r.start = value;
-    }
-    if (value >= r.end) {
-        r.end = value + 1;
+static void process_comment(const std::string& comment) {
+    if (args.verbose) {
+        fputs(comment.c_str(), stdout);
+        fprintf(stdout, "\n");
+    } else if (args.show_comment) {
+        fputs(comment.c_str(), stdout);
     }
 }
 
-static void apply_range_option(const range& in, range& out) {
-    if (in.start != -1) {
-        out.start = in.start;
-    }
-    if (in.end != -1) {
-        out.end = in.end;
-    }
+static bool in_input_range(int phys_cyl, int phys_head) {
+    return phys_cyl >= args.flat.in_cyls.start && phys_cyl < args.flat.in_cyls.end
+           && phys_head >= args.flat.in_heads.start && phys_head < args.flat.in_heads.end;
 }
 
-class SHC_t {
-public:
-    int cyl;
-    int head;
-    int sec;
-    SHC_t(int c, int h, int s) : cyl(c), head(h), sec(s) {}
-    bool operator <(const SHC_t& rhs) const {
-        if (this->cyl  < rhs.cyl)  return true;
-        if (this->cyl  > rhs.cyl)  return false;
-        if (this->head < rhs.head) return true;
-        if (this->head > rhs.head) return false;
-        if (this->sec  < rhs.sec)  return true;
-                                   return false;
-    }
-};
-
-static void write_flat(const disk_t& disk, FILE *flat) {
-    typedef std::map<SHC_t, data_t> disk_image_t;
-    disk_image_t disk_image;
-
-    // The range of C/H/S to use in the output image (based on what we load).
-    range out_cyls = {MAX_CYLS, 0};
-    range out_heads = {MAX_HEADS, 0};
-    range out_sectors = {MAX_SECS, 0};
-    int size_code = -1;
-    bool did_bell = false;
-
-    // Find the range of cylinders, heads and sectors to write.
-    // For each real sector, add a lump.
-    for_range (phys_cyl, args.in_cyls) {
-        for_range (phys_head, args.in_heads) {
-            const track_t& track = disk.tracks[phys_cyl][phys_head];
-
-            for (int phys_sec = 0; phys_sec < track.num_sectors; phys_sec++) {
-                const sector_t& sector = track.sectors[phys_sec];
-
-                // Use physical cyl and head, but logical sector.
-                // FIXME: Option to choose physical/logical values
-                int cyl = phys_cyl;
-                int head = phys_head;
-                int sec = sector.log_sector;
-
-                if (sec < args.in_sectors.start || sec >= args.in_sectors.end) {
-                    continue;
-                }
-
-                update_range(cyl, out_cyls);
-                update_range(head, out_heads);
-                update_range(sec, out_sectors);
-
-                // FIXME: Option to include/exclude bad/deleted sectors
-                if (sector.status == SECTOR_MISSING) continue;
-
-                SHC_t SHC(cyl, head, sec);
-                if (disk_image.find(SHC) != disk_image.end() && !args.permissive) {
-                    die("Two sectors found for cylinder %d head %d sector %d", cyl, head, sec);
-                }
+static void process_track(const track_t& track) {
+    if (!in_input_range(track.phys_cyl, track.phys_head)) return;
 
-                size_t data_id = 0;
-                if (sector.datas.size() != 1) {
-                    // Find the highest read count for the default option.
-                    int i = 0;
-                    data_map_t::const_iterator default_iter = sector.datas.begin();
-                    for (data_map_t::const_iterator iter = sector.datas.begin(); iter != sector.datas.end(); iter++) {
-                        if (iter->second > default_iter->second) {
-                            default_iter = iter;
-                            data_id = i;
-                        }
-                        i++;
-                    }
-                    if (!did_bell) {
-                        fprintf(stderr, "\x07");
-                        did_bell = true;
-                    }
-                    fprintf(stderr, "Enter the 'IMD data id' to use for Logical C %d H %d S %d: [default: %d, count: %d]: ",
-                        sector.log_cyl, sector.log_head, sector.log_sector,
-                        data_id, default_iter->second
-                    );
-                    char buf[100];
-                    for (;;) {
-                        if (fgets(buf, sizeof(buf), stdin) == NULL) {
-                            die_errno("Error reading stdin");
-                        }
-                        //fprintf(stderr, "Read %s\n", buf);
-                        if (strcmp(buf, "\n") == 0) {
-                            fprintf(stderr, "Using default ID of %d\n", data_id);
-                            break;
-                        } else if (sscanf(buf, "%zd", &data_id) == 1) {
-                            if (data_id < sector.datas.size()) {
-                                break;
-                            } else {
-                                fprintf(stderr, "Parsed invalid 'IMD data id': %zd. Must be less than %zd.\n: ", data_id, sector.datas.size());
-                            }
-                        } else {
-                            fprintf(stderr, "Error parsing 'IMD data id': (%d:%s)\n: ", errno, strerror(errno));
-                        }
-                    }
-                }
-                data_map_t::const_iterator iter = sector.datas.begin();
-                while (data_id--) { iter++; }
-
-                disk_image[SHC] = iter->first;
-                assert(disk_image[SHC].length() == sector_bytes(track.sector_size_code));
-
-                // Sanity check that all the sectors are the same size. TODO: Is it really a problem if some are different sizes?
-                if (size_code == -1) {
-                    size_code = track.sector_size_code;
-                } else if (track.sector_size_code != size_code) {
-                    printf("Tracks have inconsistent sector sizes: %d != %d for %d,%d,%d (total sectors per track: %d)\n",
-                        track.sector_size_code, size_code, cyl, head, sec, track.num_sectors);
-                }
-            }
-        }
+    if (args.verbose) {
+        show_track_line(track, args.show_data, stdout);
     }
-    // Override output ranges as specified in options.
-    apply_range_option(args.out_cyls, out_cyls);
-    apply_range_option(args.out_heads, out_heads);
-    apply_range_option(args.out_sectors, out_sectors);
-
-    data_t dummy_data(sector_bytes(size_code), 0xFF); // Data to write where we don't have a real sector.
-
-    // Go through the disk_image, and write all sectors out.
-    for_range (cyl, out_cyls) {
-        for_range (head, out_heads) {
-            for_range (sec, out_sectors) {
-                // For each sector that *should* exist, add a dummy lump.
-                disk_image_t::iterator sec_data_it = disk_image.find(SHC_t(cyl, head, sec));
-                fwrite(
-                    sec_data_it == disk_image.end() ? dummy_data.data() : sec_data_it->second.data(),
-                    1, sector_bytes(size_code), flat
-                );
-            }
-        }
+    if (args.flat_filename != NULL) {
+        add_flat_track(flat_image, track);
     }
 }
 
 static void usage(void) {
     fprintf(stderr, "usage: imdcat [OPTION]... IMAGE-FILE\n");
     fprintf(stderr, "\n");
+    fprintf(stderr, "  -i         write an index for the image, for faster access\n");
     fprintf(stderr, "  -n         write comment to stdout\n");
     fprintf(stderr, "  -o FILE    write sector data to flat file\n");
     fprintf(stderr, "  -v         describe loaded image (default action)\n");
     fprintf(stderr, "  -x         show hexdump of data in image\n");
+    fprintf(stderr, "  -c RANGE   limit input cylinders (default all)\n");
+    fprintf(stderr, "  -h RANGE   limit input heads (default all)\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Options for use with -o:\n");
     fprintf(stderr, "  -p         ignore duplicated input sectors\n");
-    fprintf(stderr, "  -c RANGE   limit input cylinders (default all)\n");
-    fprintf(stderr, "  -h RANGE   limit input heads (default all)\n");
+    fprintf(stderr, "  -V         for sectors with several versions of their data,\n");
+    fprintf(stderr, "             vote on each bit rather than asking which to use\n");
     fprintf(stderr, "  -s RANGE   limit input sectors (default all)\n");
     fprintf(stderr, "  -C RANGE   output cylinders (default autodetect)\n");
     fprintf(stderr, "  -H RANGE   output heads (default autodetect)\n");
@@ -223,7 +95,7 @@ static void usage(void) {
                     "ONLY, inclusive.\n");
     // FIXME: multiple input files, to be merged
     // FIXME: sort flat file by LH, LC, LS (default: LC, LH, LS)
-    // FIXME: make the input limit options work with -x, etc.
+    // FIXME: make the -s input limit option work with -x, etc.
     exit(1);
 }
 
@@ -266,24 +138,19 @@ static void parse_range(const char *in, range& out) {
 int main(int argc, char **argv) {
     args.show_comment = false;
     args.flat_filename = NULL;
+    args.build_index = false;
     args.verbose = false;
     args.show_data = false;
-    args.permissive = false;
-    args.in_cyls.start = 0;
-    args.in_cyls.end = MAX_CYLS;
-    args.in_heads.start = 0;
-    args.in_heads.end = MAX_HEADS;
-    args.in_sectors.start = 0;
-    args.in_sectors.end = MAX_SECS; // XXX logical sectors?
-    args.out_cyls.start = args.out_cyls.end = -1;
-    args.out_heads.start = args.out_heads.end = -1;
-    args.out_sectors.start = args.out_sectors.end = -1;
+    init_flat_options(args.flat);
 
     while (true) {
-        int opt = getopt(argc, argv, "no:vxpc:h:s:C:H:S:");
+        int opt = getopt(argc, argv, "ino:vxpVc:h:s:C:H:S:");
         if (opt == -1) break;
 
         switch (opt) {
+        case 'i':
+            args.build_index = true;
+            break;
         case 'n':
             args.show_comment = true;
             break;
@@ -298,25 +165,28 @@ int main(int argc, char **argv) {
             break;
 
         case 'p':
-            args.permissive = true;
+            args.flat.permissive = true;
+            break;
+        case 'V':
+            args.flat.vote = true;
             break;
         case 'c':
-            parse_range(optarg, args.in_cyls);
+            parse_range(optarg, args.flat.in_cyls);
             break;
         case 'h':
-            parse_range(optarg, args.in_heads);
+            parse_range(optarg, args.flat.in_heads);
             break;
         case 's':
-            parse_range(optarg, args.in_sectors);
+            parse_range(optarg, args.flat.in_sectors);
             break;
         case 'C':
-            parse_range(optarg, args.out_cyls);
+            parse_range(optarg, args.flat.out_cyls);
             break;
         case 'H':
-            parse_range(optarg, args.out_heads);
+            parse_range(optarg, args.flat.out_heads);
             break;
         case 'S':
-            parse_range(optarg, args.out_sectors);
+            parse_range(optarg, args.flat.out_sectors);
             break;
 
         default:
@@ -328,34 +198,106 @@ int main(int argc, char **argv) {
         usage();
     }
     args.image_filename = argv[optind];
-    if (!args.show_comment && args.flat_filename == NULL) {
+    if (!args.show_comment && args.flat_filename == NULL && !args.build_index) {
         args.verbose = true;
     }
     if (args.show_data) {
         args.verbose = true;
     }
 
-    FILE *f = fopen(args.image_filename, "rb");
-    if (f == NULL) {
-        die_errno("cannot open %s", args.image_filename);
-    }
-    disk_t disk;
-    read_imd(f, disk);
-    fclose(f);
-
-    if (args.show_comment && !args.verbose) {
-        show_comment(disk, stdout);
-    }
+    init_flat(flat_image, args.flat);
+    const std::string journal_name = journal_filename(args.image_filename);
+    if (access(journal_name.c_str(), F_OK) == 0) {
+        // dumpfloppy has been retrying reads on this image, and the latest
+        // reads are in its journal -- which needs the whole image loading
+        // before it can be applied.
+        disk_t disk;
+        map_imd(args.image_filename, disk);
+        replay_journal(journal_name.c_str(), hash_image_file(args.image_filename), disk, NULL);
+
+        process_comment(disk.comment);
+        for (int cyl = 0; cyl < disk.num_phys_cyls; cyl++) {
+            for (int head = 0; head < disk.num_phys_heads; head++) {
+                const track_t *track = find_track(disk, cyl, head);
+                if (track != NULL) {
+                    process_track(*track);
+                }
+            }
+        }
+        free_disk(disk);
+    } else {
+        // Process the image a track at a time.
+        imd_reader_t reader;
+        open_imd_file(args.image_filename, reader);
+        track_t track;
+
+        // If only some tracks are wanted and there's an index, go straight
+        // to them. Only the flat file is limited by -s, so unless the
+        // tracks are being shown too, the ones with no sectors in that
+        // range can be skipped as well.
+        imdx_t index;
+        bool used_index = false;
+        const bool all_tracks = args.flat.in_cyls.start == 0 && args.flat.in_cyls.end == MAX_CYLS
+                                && args.flat.in_heads.start == 0 && args.flat.in_heads.end == MAX_HEADS;
+        const bool all_sectors = args.verbose
+                                 || (args.flat.in_sectors.start == 0 && args.flat.in_sectors.end == MAX_SECS);
+        if (!(all_tracks && all_sectors) && load_imdx(args.image_filename, index)) {
+            std::vector<bool> wanted(MAX_CYLS * MAX_HEADS, all_sectors);
+            if (!all_sectors) {
+                std::vector<const imdx_sector_t *> sectors;
+                find_imdx_sectors(index, args.flat.in_sectors.start, args.flat.in_sectors.end, sectors);
+                for (size_t i = 0; i < sectors.size(); i++) {
+                    if (sectors[i]->phys_head < MAX_HEADS) {
+                        wanted[sectors[i]->phys_cyl * MAX_HEADS + sectors[i]->phys_head] = true;
+                    }
+                }
+            }
 
-    if (args.verbose) {
-        show_disk(disk, args.show_data, stdout);
+            if (read_imd_next(reader, track) == IMD_COMMENT) {
+                process_comment(reader.comment);
+            }
+            const int end_cyl = std::min(args.flat.in_cyls.end, MAX_CYLS);
+            const int end_head = std::min(args.flat.in_heads.end, MAX_HEADS);
+            for (int cyl = args.flat.in_cyls.start; cyl < end_cyl; cyl++) {
+                for (int head = args.flat.in_heads.start; head < end_head; head++) {
+                    if (!wanted[cyl * MAX_HEADS + head]) continue;
+                    if (!seek_imdx_track(reader, index, cyl, head)) continue;
+
+                    if (read_imd_next(reader, track) != IMD_TRACK
+                        || track.phys_cyl != cyl || track.phys_head != head) {
+                        die("Index doesn't match image");
+                    }
+                    process_track(track);
+                }
+            }
+            used_index = true;
+        }
+        while (!used_index) {
+            imd_item_t item = read_imd_next(reader, track);
+            if (item == IMD_END) break;
+
+            if (item == IMD_COMMENT) {
+                process_comment(reader.comment);
+            } else {
+                process_track(track);
+            }
+        }
+        close_imd_reader(reader);
     }
 
     if (args.flat_filename != NULL) {
-        f = fopen(args.flat_filename, "wb");
-        write_flat(disk, f);
+        FILE *f = fopen(args.flat_filename, "wb");
+        write_flat(flat_image, f);
         fclose(f);
     }
 
+    if (args.build_index) {
+        imdx_t index;
+        if (!build_imdx(args.image_filename, index)) {
+            die("Can't index %s: it contains more than one image", args.image_filename);
+        }
+        write_imdx(args.image_filename, index);
+    }
+
     return 0;
 }
@@ -0,0 +1,73 @@
+/*
+    imdgen: write a synthetic IMD file
+
+    Copyright (C) 2013 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include "disk.h"
+#include "imd.h"
+#include "synth.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static void usage(void) {
+    fprintf(stderr, "usage: imdgen [OPTION]... IMAGE-FILE\n");
+    fputs(SYNTH_USAGE, stderr);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    synth_params_t params;
+    init_synth_params(params);
+
+    while (true) {
+        int opt = getopt(argc, argv, SYNTH_OPTIONS);
+        if (opt == -1) break;
+
+        if (!parse_synth_option(opt, optarg, params)) {
+            usage();
+        }
+    }
+
+    if (optind + 1 != argc) {
+        usage();
+    }
+    const char *image_filename = argv[optind];
+
+    disk_t disk;
+    make_synth_disk(params, disk);
+
+    FILE *image = fopen(image_filename, "wb");
+    if (image == NULL) {
+        die_errno("cannot open %s for writing", image_filename);
+    }
+    write_imd_header(disk, image);
+    for (int cyl = 0; cyl < disk.num_phys_cyls; cyl++) {
+        for (int head = 0; head < disk.num_phys_heads; head++) {
+            write_imd_track(disk_track(disk, cyl, head), image);
+        }
+    }
+    if (fclose(image) != 0) {
+        die_errno("write to %s failed", image_filename);
+    }
+
+    free_disk(disk);
+    return 0;
+}
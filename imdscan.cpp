@@ -0,0 +1,352 @@
+/*
+    imdscan: describe the formats of many IMD files at once
+
+    Copyright (C) 2013 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "disk.h"
+#include "imd.h"
+#include "kernels.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+static struct args {
+    int jobs;
+} args;
+
+// Formats we can recognise from the size of the flat image of cylinders 2
+// upwards (as in "imdcat -c2: -C0: -o"). This is the same table floppyinfo
+// uses.
+typedef struct {
+    size_t flat_size;
+    const char *name;
+    const char *cpm_type;
+    const char *sides;
+} geometry_t;
+
+static const geometry_t GEOMETRIES[] = {
+    { 81920, "RM SS 40T 16x128", "rm-sd", "0" },
+    { 163840, "RM DS 40T 16x128", "rm-sd", "0 1" },
+    { 184320, "RM SS 40T 9x512", "rm-dd", "0" },
+    // FIXME: 368640 is also MS-DOS 360k
+    { 368640, "RM DS 40T 9x512", "rm-dd", "0 1" },
+    { 737280, "RM DS 80T 9x512", "rm-qd", "0 1" },
+    { 327680, "Alphatronic PC 40T 16x256", "alpha", "both" },
+    { 0, NULL, NULL, NULL } // NULL represents end of array.
+};
+
+typedef struct {
+    const char *filename;
+    bool done;
+    bool failed;
+    std::string report;
+} scan_job_t;
+
+// The jobs are claimed in order by the workers, and the reports printed in
+// order by the main thread as they're finished.
+static struct {
+    std::vector<scan_job_t> jobs;
+    size_t next_job;
+    pthread_mutex_t lock;
+    pthread_cond_t job_done;
+} pool;
+
+// What we've found out about an image so far.
+typedef struct {
+    int num_tracks;
+    int num_cyls;
+    int num_heads;
+    long secstat[SECTOR_ENUM_HIGHEST+1];
+    std::vector<const data_mode_t *> modes;
+
+    // The range of C/H/S the flat image would cover, as in imdcat.
+    int min_head, max_head, max_cyl;
+    int min_sec, max_sec;
+    int size_code;
+} scan_t;
+
+static void init_scan(scan_t& scan) {
+    scan.num_tracks = 0;
+    scan.num_cyls = 0;
+    scan.num_heads = 0;
+    for (int i = 0; i <= SECTOR_ENUM_HIGHEST; i++) {
+        scan.secstat[i] = 0;
+    }
+    scan.modes.clear();
+    scan.min_head = MAX_HEADS;
+    scan.max_head = -1;
+    scan.max_cyl = -1;
+    scan.min_sec = MAX_SECS;
+    scan.max_sec = -1;
+    scan.size_code = -1;
+}
+
+static void scan_track(const track_t& track, scan_t& scan) {
+    scan.num_tracks++;
+    if (track.phys_cyl >= scan.num_cyls) {
+        scan.num_cyls = track.phys_cyl + 1;
+    }
+    if (track.phys_head >= scan.num_heads) {
+        scan.num_heads = track.phys_head + 1;
+    }
+    if (track.num_sectors > 0) {
+        bool seen_mode = false;
+        for (size_t i = 0; i < scan.modes.size(); i++) {
+            if (scan.modes[i] == track.data_mode) {
+                seen_mode = true;
+            }
+        }
+        if (!seen_mode) {
+            scan.modes.push_back(track.data_mode);
+        }
+    }
+
+    for (int phys_sec = 0; phys_sec < track.num_sectors; phys_sec++) {
+        const sector_t& sector = track.sectors[phys_sec];
+        scan.secstat[sector.status]++;
+
+        // The flat image skips cylinders 0 and 1, which are often
+        // formatted differently.
+        if (track.phys_cyl < 2) continue;
+
+        if (track.phys_cyl > scan.max_cyl) scan.max_cyl = track.phys_cyl;
+        if (track.phys_head < scan.min_head) scan.min_head = track.phys_head;
+        if (track.phys_head > scan.max_head) scan.max_head = track.phys_head;
+        if (sector.log_sector < scan.min_sec) scan.min_sec = sector.log_sector;
+        if (sector.log_sector > scan.max_sec) scan.max_sec = sector.log_sector;
+        if (sector.status != SECTOR_MISSING && scan.size_code == -1) {
+            scan.size_code = track.sector_size_code;
+        }
+    }
+}
+
+// Return the size of the flat image, or 0 if there wouldn't be one.
+static size_t flat_size(const scan_t& scan) {
+    if (scan.max_cyl == -1 || scan.size_code == -1) {
+        return 0;
+    }
+    return size_t(scan.max_cyl + 1)
+           * (scan.max_head - scan.min_head + 1)
+           * (scan.max_sec - scan.min_sec + 1)
+           * sector_bytes(scan.size_code);
+}
+
+// Read the comment and tracks of an image, adding the comment to report.
+static void read_scan(imd_reader_t& reader, scan_t& scan, std::string& report,
+                      bool& more_images) {
+    bool seen_comment = false;
+    more_images = false;
+    track_t track;
+    while (true) {
+        imd_item_t item = read_imd_next(reader, track);
+        if (item == IMD_END) break;
+
+        if (item == IMD_COMMENT) {
+            if (seen_comment) {
+                more_images = true;
+                break;
+            }
+            seen_comment = true;
+            // Show the comment after the first line, like floppyinfo does.
+            const std::string& comment = reader.comment;
+            size_t start = comment.find('\n');
+            while (start != std::string::npos && start + 1 < comment.size()) {
+                size_t end = comment.find('\n', start + 1);
+                std::string line = comment.substr(start + 1, end == std::string::npos ? std::string::npos : end - start - 1);
+                if (!line.empty() && line[line.size() - 1] == '\r') {
+                    line.resize(line.size() - 1);
+                }
+                report += "  | " + line + "\n";
+                start = end;
+            }
+            continue;
+        }
+
+        scan_track(track, scan);
+    }
+}
+
+// Read an image and describe it in report. Return false if the image
+// couldn't be read, in which case report says why.
+static bool scan_image(const char *filename, std::string& report) {
+    report = str_sprintf("\n%s\n", filename);
+
+    imd_reader_t reader;
+    bool opened = false;
+    scan_t scan;
+    init_scan(scan);
+    bool more_images;
+    try {
+        open_imd_file(filename, reader);
+        opened = true;
+        read_scan(reader, scan, report, more_images);
+    } catch (const fatal_error_t& error) {
+        if (opened) {
+            close_imd_reader(reader);
+        }
+        report += "  Error: " + error.message + "\n";
+        return false;
+    }
+    close_imd_reader(reader);
+
+    report += str_sprintf("  Tracks: %d (%d cyls, %d heads)\n",
+                          scan.num_tracks, scan.num_cyls, scan.num_heads);
+    report += str_sprintf("  Sectors: %ld good, %ld bad, %ld missing\n",
+                          scan.secstat[SECTOR_GOOD], scan.secstat[SECTOR_BAD],
+                          scan.secstat[SECTOR_MISSING]);
+    report += "  Modes:";
+    for (size_t i = 0; i < scan.modes.size(); i++) {
+        report += " ";
+        report += scan.modes[i]->name;
+    }
+    report += "\n";
+
+    const size_t size = flat_size(scan);
+    const geometry_t *geometry = NULL;
+    for (int i = 0; GEOMETRIES[i].name != NULL; i++) {
+        if (GEOMETRIES[i].flat_size == size) {
+            geometry = &GEOMETRIES[i];
+        }
+    }
+    if (geometry != NULL) {
+        report += str_sprintf("  Format: %s (CP/M %s, sides %s)\n",
+                              geometry->name, geometry->cpm_type,
+                              geometry->sides);
+    } else {
+        report += str_sprintf("  Format: unrecognised size: %zd\n", size);
+    }
+    if (more_images) {
+        report += "  (File contains more than one image; only the first is described.)\n";
+    }
+    return true;
+}
+
+static void *scan_worker(void *arg) {
+    (void) arg;
+    // A broken image only stops the scan of that image.
+    throw_fatal_errors();
+
+    while (true) {
+        pthread_mutex_lock(&pool.lock);
+        const size_t i = pool.next_job;
+        if (i < pool.jobs.size()) {
+            pool.next_job++;
+        }
+        pthread_mutex_unlock(&pool.lock);
+        if (i >= pool.jobs.size()) break;
+
+        std::string report;
+        const bool ok = scan_image(pool.jobs[i].filename, report);
+
+        pthread_mutex_lock(&pool.lock);
+        pool.jobs[i].report.swap(report);
+        pool.jobs[i].failed = !ok;
+        pool.jobs[i].done = true;
+        pthread_cond_broadcast(&pool.job_done);
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    return NULL;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+        "usage: imdscan [OPTION]... IMAGE-FILE...\n"
+        "  -j NUM     scan NUM images at once (default: number of CPUs)\n"
+    );
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    args.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while (true) {
+        int opt = getopt(argc, argv, "j:");
+        if (opt == -1) break;
+
+        switch (opt) {
+        case 'j':
+            args.jobs = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (optind >= argc) {
+        usage();
+    }
+    if (args.jobs < 1) {
+        args.jobs = 1;
+    }
+
+    // Pick the kernels before there's any chance of a race to do so.
+    init_kernels();
+
+    for (int i = optind; i < argc; i++) {
+        scan_job_t job;
+        job.filename = argv[i];
+        job.done = false;
+        job.failed = false;
+        pool.jobs.push_back(job);
+    }
+    pool.next_job = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.job_done, NULL);
+
+    if (size_t(args.jobs) > pool.jobs.size()) {
+        args.jobs = pool.jobs.size();
+    }
+    std::vector<pthread_t> workers(args.jobs);
+    for (int i = 0; i < args.jobs; i++) {
+        if (pthread_create(&workers[i], NULL, scan_worker, NULL) != 0) {
+            die("cannot create worker thread");
+        }
+    }
+
+    // Print the reports in order, as soon as they're ready.
+    int result = 0;
+    for (size_t i = 0; i < pool.jobs.size(); i++) {
+        pthread_mutex_lock(&pool.lock);
+        while (!pool.jobs[i].done) {
+            pthread_cond_wait(&pool.job_done, &pool.lock);
+        }
+        std::string report;
+        report.swap(pool.jobs[i].report);
+        if (pool.jobs[i].failed) {
+            result = 1;
+        }
+        pthread_mutex_unlock(&pool.lock);
+
+        fputs(report.c_str(), stdout);
+        fflush(stdout);
+    }
+
+    for (int i = 0; i < args.jobs; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    return result;
+}
@@ -0,0 +1,292 @@
+/*
+    imdx.cpp: random-access index for IMD files
+
+    Copyright (C) 2013 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "disk.h"
+#include "imd.h"
+#include "imdx.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+static const char IMDX_MAGIC[] = "DFX4";
+#define IMDX_MAGIC_LEN 4
+#define IMDX_HEADER_LEN (IMDX_MAGIC_LEN + 8 + 8 + 4 + 8 + 4 + 4)
+#define IMDX_TRACK_LEN 16
+#define IMDX_SECTOR_LEN 20
+
+std::string imdx_filename(const char *image_filename) {
+    return str_sprintf("%s.imdx", image_filename);
+}
+
+static void stat_image(const char *image_filename, struct stat& st) {
+    if (stat(image_filename, &st) != 0) {
+        die_errno("stat failed on %s", image_filename);
+    }
+}
+
+static bool sector_less(const imdx_sector_t& a, const imdx_sector_t& b) {
+    if (a.log_cyl != b.log_cyl) return a.log_cyl < b.log_cyl;
+    if (a.log_head != b.log_head) return a.log_head < b.log_head;
+    return a.log_sector < b.log_sector;
+}
+
+bool build_imdx(const char *image_filename, imdx_t& index) {
+    struct stat st;
+    stat_image(image_filename, st);
+    index.image_size = st.st_size;
+    index.image_mtime_sec = st.st_mtim.tv_sec;
+    index.image_mtime_nsec = st.st_mtim.tv_nsec;
+    index.image_hash = hash_image_file(image_filename);
+    index.tracks.clear();
+    index.sectors.clear();
+
+    imd_reader_t reader;
+    open_imd_file(image_filename, reader);
+    std::vector<uint64_t> sector_offsets;
+    reader.sector_offsets = &sector_offsets;
+
+    track_t track;
+    bool ok = (read_imd_next(reader, track) == IMD_COMMENT);
+    while (ok) {
+        const uint64_t offset = imd_reader_offset(reader);
+        imd_item_t item = read_imd_next(reader, track);
+        if (item == IMD_END) break;
+        if (item == IMD_COMMENT) {
+            // More than one image in the file.
+            ok = false;
+            break;
+        }
+        const uint64_t end = imd_reader_offset(reader);
+
+        imdx_track_t entry;
+        entry.phys_cyl = track.phys_cyl;
+        entry.phys_head = track.phys_head;
+        entry.length = end - offset;
+        entry.offset = offset;
+        index.tracks.push_back(entry);
+
+        for (int phys_sec = 0; phys_sec < track.num_sectors; phys_sec++) {
+            const sector_t& sector = track.sectors[phys_sec];
+            const uint64_t sector_end = (phys_sec + 1 < track.num_sectors) ? sector_offsets[phys_sec + 1] : end;
+
+            imdx_sector_t sec_entry;
+            sec_entry.log_cyl = sector.log_cyl;
+            sec_entry.log_head = sector.log_head;
+            sec_entry.log_sector = sector.log_sector;
+            sec_entry.phys_cyl = track.phys_cyl;
+            sec_entry.phys_head = track.phys_head;
+            sec_entry.phys_sec = phys_sec;
+            sec_entry.length = sector_end - sector_offsets[phys_sec];
+            sec_entry.offset = sector_offsets[phys_sec];
+            index.sectors.push_back(sec_entry);
+        }
+    }
+    close_imd_reader(reader);
+
+    // Keep sectors with the same address in file order.
+    std::stable_sort(index.sectors.begin(), index.sectors.end(), sector_less);
+    return ok;
+}
+
+bool load_imdx(const char *image_filename, imdx_t& index) {
+    std::vector<uint8_t> contents;
+    if (!read_whole_file(imdx_filename(image_filename).c_str(), contents)) {
+        return false;
+    }
+    if (contents.size() < IMDX_HEADER_LEN
+        || memcmp(&contents[0], IMDX_MAGIC, IMDX_MAGIC_LEN) != 0) {
+        return false;
+    }
+
+    const uint8_t *p = &contents[IMDX_MAGIC_LEN];
+    index.image_size = get_be64(p);
+    index.image_mtime_sec = get_be64(p + 8);
+    index.image_mtime_nsec = get_be32(p + 16);
+    index.image_hash = get_be64(p + 20);
+    const uint32_t num_tracks = get_be32(p + 28);
+    const uint32_t num_sectors = get_be32(p + 32);
+    if (contents.size() != IMDX_HEADER_LEN + (uint64_t(num_tracks) * IMDX_TRACK_LEN)
+                            + (uint64_t(num_sectors) * IMDX_SECTOR_LEN)) {
+        return false;
+    }
+
+    // Check it's for this version of the image.
+    struct stat st;
+    stat_image(image_filename, st);
+    if (uint64_t(st.st_size) != index.image_size) {
+        return false;
+    }
+    if (st.st_mtim.tv_sec != index.image_mtime_sec
+        || uint32_t(st.st_mtim.tv_nsec) != index.image_mtime_nsec) {
+        // Touched, but maybe not changed.
+        if (hash_image_file(image_filename) != index.image_hash) {
+            return false;
+        }
+    }
+
+    p = &contents[IMDX_HEADER_LEN];
+    index.tracks.resize(num_tracks);
+    for (uint32_t i = 0; i < num_tracks; i++, p += IMDX_TRACK_LEN) {
+        imdx_track_t& entry = index.tracks[i];
+        entry.phys_cyl = p[0];
+        entry.phys_head = p[1];
+        entry.length = get_be32(p + 4);
+        entry.offset = get_be64(p + 8);
+    }
+    index.sectors.resize(num_sectors);
+    for (uint32_t i = 0; i < num_sectors; i++, p += IMDX_SECTOR_LEN) {
+        imdx_sector_t& entry = index.sectors[i];
+        entry.log_cyl = p[0];
+        entry.log_head = p[1];
+        entry.log_sector = p[2];
+        entry.phys_cyl = p[3];
+        entry.phys_head = p[4];
+        entry.phys_sec = p[5];
+        entry.length = get_be32(p + 8);
+        entry.offset = get_be64(p + 12);
+    }
+    return true;
+}
+
+void write_imdx(const char *image_filename, const imdx_t& index) {
+    std::vector<uint8_t> buf(IMDX_MAGIC, IMDX_MAGIC + IMDX_MAGIC_LEN);
+    put_be64(buf, index.image_size);
+    put_be64(buf, index.image_mtime_sec);
+    put_be32(buf, index.image_mtime_nsec);
+    put_be64(buf, index.image_hash);
+    put_be32(buf, index.tracks.size());
+    put_be32(buf, index.sectors.size());
+    for (size_t i = 0; i < index.tracks.size(); i++) {
+        const imdx_track_t& entry = index.tracks[i];
+        buf.push_back(entry.phys_cyl);
+        buf.push_back(entry.phys_head);
+        buf.push_back(0);
+        buf.push_back(0);
+        put_be32(buf, entry.length);
+        put_be64(buf, entry.offset);
+    }
+    for (size_t i = 0; i < index.sectors.size(); i++) {
+        const imdx_sector_t& entry = index.sectors[i];
+        buf.push_back(entry.log_cyl);
+        buf.push_back(entry.log_head);
+        buf.push_back(entry.log_sector);
+        buf.push_back(entry.phys_cyl);
+        buf.push_back(entry.phys_head);
+        buf.push_back(entry.phys_sec);
+        buf.push_back(0);
+        buf.push_back(0);
+        put_be32(buf, entry.length);
+        put_be64(buf, entry.offset);
+    }
+
+    // Write a new file and rename it, so a reader never sees half an index.
+    const std::string filename = imdx_filename(image_filename);
+    const std::string filename_in_progress = filename + ".in_progress";
+    FILE *f = fopen(filename_in_progress.c_str(), "wb");
+    if (f == NULL) {
+        die_errno("cannot open %s for writing", filename_in_progress.c_str());
+    }
+    if (fwrite(&buf[0], 1, buf.size(), f) != buf.size() || fclose(f) != 0) {
+        die_errno("write to %s failed", filename_in_progress.c_str());
+    }
+    if (rename(filename_in_progress.c_str(), filename.c_str()) != 0) {
+        die_errno("rename \"%s\" to \"%s\" failed", filename_in_progress.c_str(), filename.c_str());
+    }
+}
+
+void update_imdx(const char *image_filename) {
+    imdx_t index;
+    if (load_imdx(image_filename, index)) {
+        return;
+    }
+    if (build_imdx(image_filename, index)) {
+        write_imdx(image_filename, index);
+    }
+}
+
+const imdx_track_t *find_imdx_track(const imdx_t& index,
+                                    int phys_cyl, int phys_head) {
+    for (size_t i = 0; i < index.tracks.size(); i++) {
+        const imdx_track_t& entry = index.tracks[i];
+        if (entry.phys_cyl == phys_cyl && entry.phys_head == phys_head) {
+            return &entry;
+        }
+    }
+    return NULL;
+}
+
+static imdx_sector_t sector_key(int log_cyl, int log_head, int log_sector) {
+    imdx_sector_t key;
+    key.log_cyl = log_cyl;
+    key.log_head = log_head;
+    key.log_sector = log_sector;
+    return key;
+}
+
+const imdx_sector_t *find_imdx_sector(const imdx_t& index,
+                                      int log_cyl, int log_head,
+                                      int log_sector) {
+    const imdx_sector_t key = sector_key(log_cyl, log_head, log_sector);
+    std::vector<imdx_sector_t>::const_iterator it
+        = std::lower_bound(index.sectors.begin(), index.sectors.end(), key, sector_less);
+    if (it == index.sectors.end() || sector_less(key, *it)) {
+        return NULL;
+    }
+    return &*it;
+}
+
+void find_imdx_sectors(const imdx_t& index, int start_sec, int end_sec,
+                       std::vector<const imdx_sector_t *>& found) {
+    found.clear();
+    std::vector<imdx_sector_t>::const_iterator it = index.sectors.begin();
+    const std::vector<imdx_sector_t>::const_iterator end = index.sectors.end();
+    while (it != end) {
+        // Skip to the first wanted sector of this logical track, take the
+        // ones in range, then skip to the next track.
+        const int log_cyl = it->log_cyl;
+        const int log_head = it->log_head;
+        it = std::lower_bound(it, end, sector_key(log_cyl, log_head, std::max(start_sec, 0)),
+                              sector_less);
+        for (; it != end && it->log_cyl == log_cyl && it->log_head == log_head
+               && it->log_sector < end_sec; ++it) {
+            found.push_back(&*it);
+        }
+        it = std::upper_bound(it, end, sector_key(log_cyl, log_head, 0xFF), sector_less);
+    }
+}
+
+bool seek_imdx_track(imd_reader_t& reader, const imdx_t& index,
+                     int phys_cyl, int phys_head) {
+    const imdx_track_t *entry = find_imdx_track(index, phys_cyl, phys_head);
+    if (entry == NULL) {
+        return false;
+    }
+    seek_imd_reader(reader, entry->offset);
+    return true;
+}
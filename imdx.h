@@ -0,0 +1,118 @@
+/*
+    imdx.h: random-access index for IMD files
+
+    Copyright (C) 2013 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+    IMD is a sequential format, so finding a track means parsing every track
+    before it. IMAGE.imdx records where each track and sector is in IMAGE, so
+    a reader can seek straight to them. The index is only ever a shortcut: if
+    it's missing or out of date, the image is read sequentially as usual.
+
+    The file is made up of (with integers big-endian):
+
+      "DFX4" size[8] mtime_sec[8] mtime_nsec[4] hash[8]
+        num_tracks[4] num_sectors[4]
+        The size, modification time and data_hash of the image. If the size
+        and time match, the index is trusted; if not, the image is hashed to
+        see if it has really changed.
+
+      num_tracks * { cyl head 0 0 length[4] offset[8] }
+        Where each track starts in the image, in file order.
+
+      num_sectors * { log_cyl log_head log_sector phys_cyl phys_head
+                      phys_sec 0 0 length[4] offset[8] }
+        Where each sector's data records are, sorted by logical address.
+
+    Only files that contain a single image can be indexed.
+*/
+
+#ifndef IMDX_H
+#define IMDX_H
+
+#include "imd.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+typedef struct {
+    uint8_t phys_cyl;
+    uint8_t phys_head;
+    uint32_t length;
+    uint64_t offset;
+} imdx_track_t;
+
+typedef struct {
+    uint8_t log_cyl;
+    uint8_t log_head;
+    uint8_t log_sector;
+    uint8_t phys_cyl;
+    uint8_t phys_head;
+    uint8_t phys_sec;
+    uint32_t length;
+    uint64_t offset;
+} imdx_sector_t;
+
+typedef struct {
+    uint64_t image_size;
+    int64_t image_mtime_sec;
+    uint32_t image_mtime_nsec;
+    uint64_t image_hash;
+    std::vector<imdx_track_t> tracks;
+    std::vector<imdx_sector_t> sectors;
+} imdx_t;
+
+// Get the index filename for an image.
+std::string imdx_filename(const char *image_filename);
+
+// Build an index by reading through an image. Return false if the image
+// can't be indexed.
+bool build_imdx(const char *image_filename, imdx_t& index);
+
+// Load the index for an image. Return false if there isn't one, or it
+// doesn't match the image.
+bool load_imdx(const char *image_filename, imdx_t& index);
+
+void write_imdx(const char *image_filename, const imdx_t& index);
+
+// Build and write the index for an image, if it doesn't already have an
+// up-to-date one.
+void update_imdx(const char *image_filename);
+
+// Find a track by physical address, or a sector by logical address.
+// Return NULL if it's not in the index.
+const imdx_track_t *find_imdx_track(const imdx_t& index,
+                                    int phys_cyl, int phys_head);
+const imdx_sector_t *find_imdx_sector(const imdx_t& index,
+                                      int log_cyl, int log_head,
+                                      int log_sector);
+
+// Find the sectors whose logical sector number is at least start_sec and
+// less than end_sec, on every logical track, in logical order.
+void find_imdx_sectors(const imdx_t& index, int start_sec, int end_sec,
+                       std::vector<const imdx_sector_t *>& found);
+
+// Move a reader to the start of a track, so the next read_imd_next returns
+// it. Return false if the track isn't in the index.
+bool seek_imdx_track(imd_reader_t& reader, const imdx_t& index,
+                     int phys_cyl, int phys_head);
+
+#endif
@@ -0,0 +1,262 @@
+/*
+    journal.cpp: append-only log of sector reads made while retrying
+
+    Copyright (C) 2013 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "disk.h"
+#include "imd.h"
+#include "journal.h"
+#include "kernels.h"
+#include "util.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+static const char JOURNAL_MAGIC[] = "DFJ2";
+#define JOURNAL_MAGIC_LEN 4
+#define JOURNAL_HEADER_LEN (JOURNAL_MAGIC_LEN + 8)
+
+#define RECORD_LAYOUT 'L'
+#define RECORD_READ 'R'
+#define READ_HEADER_LEN 17
+
+std::string journal_filename(const char *image_filename) {
+    return str_sprintf("%s.journal", image_filename);
+}
+
+void open_journal(const char *filename, uint64_t image_hash, size_t length,
+                  journal_t& journal) {
+    journal.fd = open(filename, O_CREAT|O_WRONLY|O_APPEND, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+    if (journal.fd == -1) {
+        die_errno("cannot open %s for writing", filename);
+    }
+    // Two captures appending to the same journal would be a mess.
+    if (flock(journal.fd, LOCK_EX|LOCK_NB) != 0) {
+        die_errno("cannot lock %s", filename);
+    }
+
+    // Drop anything after the last complete record, so new records follow on
+    // from it.
+    if (length < JOURNAL_HEADER_LEN) {
+        length = 0;
+    }
+    if (ftruncate(journal.fd, length) != 0) {
+        die_errno("cannot truncate %s", filename);
+    }
+    if (length == 0) {
+        journal.buf.assign(JOURNAL_MAGIC, JOURNAL_MAGIC + JOURNAL_MAGIC_LEN);
+        put_be64(journal.buf, image_hash);
+        write_all(journal.fd, &journal.buf[0], journal.buf.size());
+    }
+}
+
+void close_journal(journal_t& journal) {
+    if (journal.fd != -1) {
+        close(journal.fd);
+        journal.fd = -1;
+    }
+}
+
+void journal_layout(journal_t& journal, const track_t& track) {
+    if (journal.fd == -1) return;
+
+    journal.buf.clear();
+    journal.buf.push_back(RECORD_LAYOUT);
+    journal.buf.push_back(track.phys_cyl);
+    journal.buf.push_back(track.phys_head);
+    journal.buf.push_back(track.data_mode->imd_mode);
+    journal.buf.push_back(track.sector_size_code);
+    journal.buf.push_back(track.num_sectors);
+    for (int i = 0; i < track.num_sectors; i++) {
+        const sector_t& sector = track.sectors[i];
+        journal.buf.push_back(sector.log_cyl);
+        journal.buf.push_back(sector.log_head);
+        journal.buf.push_back(sector.log_sector);
+    }
+    write_all(journal.fd, &journal.buf[0], journal.buf.size());
+}
+
+void journal_read(journal_t& journal, const track_t& track, int phys_sec,
+                  int flags, const uint8_t *data, size_t len, bool new_data) {
+    if (journal.fd == -1) return;
+
+    if (new_data) {
+        flags |= JOURNAL_HAS_DATA;
+    } else {
+        // The reader will already have this data.
+        assert((flags & JOURNAL_REPLACE) == 0);
+    }
+
+    journal.buf.clear();
+    journal.buf.push_back(RECORD_READ);
+    journal.buf.push_back(track.phys_cyl);
+    journal.buf.push_back(track.phys_head);
+    journal.buf.push_back(phys_sec);
+    journal.buf.push_back(flags);
+    put_be64(journal.buf, data_hash(data, len));
+    put_be32(journal.buf, len);
+    if (new_data) {
+        journal.buf.insert(journal.buf.end(), data, data + len);
+    }
+    write_all(journal.fd, &journal.buf[0], journal.buf.size());
+}
+
+// Apply a layout record, returning its length, or 0 if it's incomplete.
+static size_t replay_layout(const uint8_t *p, size_t avail, disk_t& disk) {
+    if (avail < 6) return 0;
+    const int num_sectors = p[5];
+    const size_t len = 6 + 3 * num_sectors;
+    if (avail < len) return 0;
+
+    const int cyl = p[1];
+    const int head = p[2];
+    if (head >= MAX_HEADS) {
+        die("Journal has a track with bad head %d", head);
+    }
+    track_t& track = disk_track(disk, cyl, head);
+    init_track(cyl, head, track);
+    track.status = TRACK_PROBED;
+    track.data_mode = find_data_mode(p[3]);
+    if (track.data_mode == NULL) {
+        die("Journal has a track with unknown mode %d", p[3]);
+    }
+    track.sector_size_code = p[4];
+    resize_track(track, num_sectors);
+    for (int i = 0; i < num_sectors; i++) {
+        sector_t& sector = track.sectors[i];
+        sector.log_cyl = p[6 + 3 * i];
+        sector.log_head = p[6 + 3 * i + 1];
+        sector.log_sector = p[6 + 3 * i + 2];
+    }
+
+    if (cyl >= disk.num_phys_cyls) {
+        disk.num_phys_cyls = cyl + 1;
+    }
+    if (head >= disk.num_phys_heads) {
+        disk.num_phys_heads = head + 1;
+    }
+    return len;
+}
+
+// Apply a read record, returning its length, or 0 if it's incomplete.
+static size_t replay_read(const uint8_t *p, size_t avail, disk_t& disk) {
+    if (avail < READ_HEADER_LEN) return 0;
+    const int flags = p[4];
+    const uint64_t hash = get_be64(p + 5);
+    const uint32_t data_len = get_be32(p + 13);
+    const size_t len = READ_HEADER_LEN + ((flags & JOURNAL_HAS_DATA) ? data_len : 0);
+    if (avail < len) return 0;
+
+    const int cyl = p[1];
+    const int head = p[2];
+    const int phys_sec = p[3];
+    const track_t *found = head < MAX_HEADS ? find_track(disk, cyl, head) : NULL;
+    if (found == NULL || phys_sec >= found->num_sectors
+        || data_len != sector_bytes(found->sector_size_code)) {
+        die("Journal doesn't match image at %d.%d sector %d", cyl, head, phys_sec);
+    }
+    sector_t& sector = disk_track(disk, cyl, head).sectors[phys_sec];
+    const bool deleted = (flags & JOURNAL_DELETED) != 0;
+
+    if (flags & JOURNAL_HAS_DATA) {
+        const uint8_t *data = p + READ_HEADER_LEN;
+        if (flags & JOURNAL_GOOD) {
+            record_good_read(sector, data, data_len, deleted, (flags & JOURNAL_REPLACE) != 0);
+        } else {
+            record_bad_read(sector, data, data_len, deleted);
+        }
+        return len;
+    }
+
+    // We've seen this data before; find it again by its hash.
+    data_variant_t *variant = sector.datas.find_hash(hash, data_len);
+    if (variant == NULL) {
+        die("Journal refers to unknown data at %d.%d sector %d", cyl, head, phys_sec);
+    }
+    sector.deleted = deleted;
+    if (flags & JOURNAL_GOOD) {
+        sector.status = SECTOR_GOOD;
+    } else {
+        sector.status = SECTOR_BAD;
+        if (variant->count != UINT32_MAX) {
+            variant->count++;
+        }
+    }
+    return len;
+}
+
+journal_status_t replay_journal(const char *filename, uint64_t image_hash,
+                                disk_t& disk, size_t *length) {
+    if (length != NULL) {
+        *length = 0;
+    }
+
+    std::vector<uint8_t> contents;
+    if (!read_whole_file(filename, contents)) {
+        return JOURNAL_NONE;
+    }
+
+    if (contents.size() < JOURNAL_HEADER_LEN) {
+        // Interrupted before the header was written.
+        return JOURNAL_NONE;
+    }
+    if (memcmp(&contents[0], JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) != 0) {
+        die("%s is not a dumpfloppy journal", filename);
+    }
+    if (get_be64(&contents[JOURNAL_MAGIC_LEN]) != image_hash) {
+        return JOURNAL_STALE;
+    }
+
+    size_t pos = JOURNAL_HEADER_LEN;
+    while (pos < contents.size()) {
+        const uint8_t *p = &contents[pos];
+        const size_t avail = contents.size() - pos;
+        size_t len = 0;
+        switch (p[0]) {
+        case RECORD_LAYOUT:
+            len = replay_layout(p, avail, disk);
+            break;
+        case RECORD_READ:
+            len = replay_read(p, avail, disk);
+            break;
+        default:
+            die("Journal record type %d unknown", p[0]);
+        }
+        if (len == 0) {
+            // A partial record left by an interrupted write.
+            break;
+        }
+        pos += len;
+    }
+
+    if (length != NULL) {
+        *length = pos;
+    }
+    return JOURNAL_APPLIED;
+}
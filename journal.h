@@ -0,0 +1,100 @@
+/*
+    journal.h: append-only log of sector reads made while retrying
+
+    Copyright (C) 2013 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+    When dumpfloppy retries reads on an existing image, rather than rewriting
+    the whole image it appends what it reads to IMAGE.journal. Loading the
+    image and then replaying the journal gives the up-to-date disk; the
+    journal is compacted into the image once it's no longer worth keeping.
+
+    The journal starts with "DFJ2" and the data_hash of the image file it
+    applies to (big-endian), so a journal left over from a different version
+    of the image is never replayed. Then there's a sequence of records:
+
+      'L' cyl head mode size_code num_sectors {log_cyl log_head log_sector}...
+        A track was probed, with this layout. Reads of the track before this
+        are discarded.
+
+      'R' cyl head phys_sec flags hash[8] length[4] [data]
+        A read of a sector. flags is a combination of the JOURNAL_* values
+        below; the data is only included if the sector didn't already have a
+        variant with this hash.
+
+    Each record is written with a single write, so an interrupted capture
+    can at worst leave a partial record at the end, which is ignored (and
+    overwritten when the journal is next opened).
+*/
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "disk.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#define JOURNAL_GOOD     0x01 // Read was good (otherwise, bad CRC)
+#define JOURNAL_DELETED  0x02 // Sector had a deleted data mark
+#define JOURNAL_REPLACE  0x04 // Forget earlier reads of the sector
+#define JOURNAL_HAS_DATA 0x08 // Data follows
+
+// A journal that's open for appending. If fd is -1, records are ignored.
+typedef struct {
+    int fd;
+    std::vector<uint8_t> buf;
+} journal_t;
+
+// Get the journal filename for an image.
+std::string journal_filename(const char *image_filename);
+
+// Open a journal for appending, creating it if it doesn't exist.
+// image_hash identifies the image file the journal applies to. length is
+// the length of the existing journal as returned by replay_journal, or 0
+// to start a new journal.
+void open_journal(const char *filename, uint64_t image_hash, size_t length,
+                  journal_t& journal);
+void close_journal(journal_t& journal);
+
+// Record the layout of a track that has just been probed.
+void journal_layout(journal_t& journal, const track_t& track);
+
+// Record a read of a sector, which has already been applied to the sector
+// with record_good_read or record_bad_read. new_data is what they returned.
+void journal_read(journal_t& journal, const track_t& track, int phys_sec,
+                  int flags, const uint8_t *data, size_t len, bool new_data);
+
+typedef enum {
+    JOURNAL_NONE = 0,
+    JOURNAL_APPLIED,
+    JOURNAL_STALE
+} journal_status_t;
+
+// Apply the records in a journal to a disk, returning JOURNAL_NONE if there
+// isn't a journal, or JOURNAL_STALE if it's for a different image file.
+// If length isn't NULL, it's set to the length of the complete records
+// that were applied.
+journal_status_t replay_journal(const char *filename, uint64_t image_hash,
+                                disk_t& disk, size_t *length);
+
+#endif
@@ -0,0 +1,336 @@
+/*
+    kernels.c: fast operations on blocks of sector data
+
+    Copyright (C) 2013 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include "kernels.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/*
+    The hash works on 64-byte stripes, each treated as eight 64-bit lanes,
+    with an accumulator per lane. For each lane, the data is XORed with a
+    key word and a tweak made from the stripe's index, and the product of
+    the result's two 32-bit halves is added to the accumulator; the raw
+    data is added to the neighbouring lane's accumulator too, so a change
+    that the multiply happens to cancel out still shows. This only needs
+    32x32->64 multiplies, which SSE2 and AVX2 can do several of at once.
+
+    Adding is commutative, so without the tweak two stripes that use the
+    same key words (every eighth stripe does) could be swapped without
+    changing the hash.
+
+    A trailing partial stripe is zero-padded (the length is mixed in at the
+    end, so this doesn't cause collisions).
+*/
+
+#define HASH_STRIPE 64
+#define HASH_LANES 8
+
+static const uint64_t HASH_KEY[16] = {
+    0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL,
+    0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+    0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL,
+    0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL,
+    0xcb00c391bb52283cULL, 0xa32e531b8b65d088ULL,
+    0x4ef90da297486471ULL, 0xd8acdea946ef1938ULL,
+    0x3f349ce33f76faa8ULL, 0x1d4f0bc7c7bbdcf9ULL,
+    0x3159b4cd4be0518aULL, 0x647378d9c97e9fc8ULL,
+};
+
+// The key words used for a stripe start this far into HASH_KEY.
+static inline size_t hash_key_offset(size_t stripe) {
+    return stripe & 7;
+}
+
+// Mixed into every key word for a stripe, so where it is matters.
+static inline uint64_t hash_stripe_tweak(size_t stripe) {
+    return (uint64_t) stripe * 0x9E3779B97F4A7C15ULL;
+}
+
+static inline uint64_t load64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static void hash_stripe_scalar(uint64_t acc[HASH_LANES], const uint8_t *data,
+                               size_t stripe) {
+    const uint64_t *key = HASH_KEY + hash_key_offset(stripe);
+    const uint64_t tweak = hash_stripe_tweak(stripe);
+    for (int i = 0; i < HASH_LANES; i++) {
+        const uint64_t d = load64(data + 8 * i);
+        const uint64_t dk = d ^ key[i] ^ tweak;
+        acc[i] += (dk & 0xFFFFFFFFULL) * (dk >> 32);
+        acc[i ^ 1] += d;
+    }
+}
+
+static void hash_init(uint64_t acc[HASH_LANES]) {
+    for (int i = 0; i < HASH_LANES; i++) {
+        acc[i] = HASH_KEY[8 + i];
+    }
+}
+
+// Hash the partial stripe at the end (if any), and combine the
+// accumulators.
+static uint64_t hash_finish(uint64_t acc[HASH_LANES], const uint8_t *data,
+                            size_t len) {
+    const size_t done = len - (len % HASH_STRIPE);
+    if (done != len) {
+        uint8_t last[HASH_STRIPE];
+        memset(last, 0, sizeof last);
+        memcpy(last, data + done, len - done);
+        hash_stripe_scalar(acc, last, done / HASH_STRIPE);
+    }
+
+    uint64_t hash = len * 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < HASH_LANES; i++) {
+        hash = (hash ^ acc[i]) * 0xFF51AFD7ED558CCDULL;
+        hash ^= hash >> 29;
+    }
+    hash ^= hash >> 32;
+    hash *= 0xC4CEB9FE1A85EC53ULL;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+static bool is_uniform_scalar(const uint8_t *data, size_t len) {
+    for (size_t i = 1; i < len; i++) {
+        if (data[i] != data[0]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool equal_scalar(const uint8_t *a, const uint8_t *b, size_t len) {
+    return memcmp(a, b, len) == 0;
+}
+
+static void fill_scalar(uint8_t *data, uint8_t fill, size_t len) {
+    memset(data, fill, len);
+}
+
+static uint64_t hash_scalar(const uint8_t *data, size_t len) {
+    uint64_t acc[HASH_LANES];
+    hash_init(acc);
+    for (size_t stripe = 0; (stripe + 1) * HASH_STRIPE <= len; stripe++) {
+        hash_stripe_scalar(acc, data + stripe * HASH_STRIPE, stripe);
+    }
+    return hash_finish(acc, data, len);
+}
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("sse2")))
+static bool is_uniform_sse2(const uint8_t *data, size_t len) {
+    if (len == 0) return true;
+
+    const __m128i first = _mm_set1_epi8(data[0]);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i *) (data + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, first)) != 0xFFFF) {
+            return false;
+        }
+    }
+    for (; i < len; i++) {
+        if (data[i] != data[0]) return false;
+    }
+    return true;
+}
+
+__attribute__((target("sse2")))
+static bool equal_sse2(const uint8_t *a, const uint8_t *b, size_t len) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        const __m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+        const __m128i vb = _mm_loadu_si128((const __m128i *) (b + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xFFFF) {
+            return false;
+        }
+    }
+    return memcmp(a + i, b + i, len - i) == 0;
+}
+
+__attribute__((target("sse2")))
+static void fill_sse2(uint8_t *data, uint8_t fill, size_t len) {
+    const __m128i v = _mm_set1_epi8(fill);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        _mm_storeu_si128((__m128i *) (data + i), v);
+    }
+    memset(data + i, fill, len - i);
+}
+
+__attribute__((target("sse2")))
+static uint64_t hash_sse2(const uint8_t *data, size_t len) {
+    uint64_t acc_words[HASH_LANES];
+    hash_init(acc_words);
+
+    // Each register holds two lanes.
+    __m128i acc[4];
+    for (int j = 0; j < 4; j++) {
+        acc[j] = _mm_loadu_si128((const __m128i *) (acc_words + 2 * j));
+    }
+    for (size_t stripe = 0; (stripe + 1) * HASH_STRIPE <= len; stripe++) {
+        const uint8_t *p = data + stripe * HASH_STRIPE;
+        const uint64_t *key = HASH_KEY + hash_key_offset(stripe);
+        const __m128i tweak = _mm_set1_epi64x(hash_stripe_tweak(stripe));
+        for (int j = 0; j < 4; j++) {
+            const __m128i d = _mm_loadu_si128((const __m128i *) (p + 16 * j));
+            const __m128i k = _mm_loadu_si128((const __m128i *) (key + 2 * j));
+            const __m128i dk = _mm_xor_si128(d, _mm_xor_si128(k, tweak));
+            const __m128i product = _mm_mul_epu32(dk, _mm_srli_epi64(dk, 32));
+            const __m128i swapped = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+            acc[j] = _mm_add_epi64(acc[j], _mm_add_epi64(product, swapped));
+        }
+    }
+    for (int j = 0; j < 4; j++) {
+        _mm_storeu_si128((__m128i *) (acc_words + 2 * j), acc[j]);
+    }
+    return hash_finish(acc_words, data, len);
+}
+
+__attribute__((target("avx2")))
+static bool is_uniform_avx2(const uint8_t *data, size_t len) {
+    if (len == 0) return true;
+
+    const __m256i first = _mm256_set1_epi8(data[0]);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        const __m256i v = _mm256_loadu_si256((const __m256i *) (data + i));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, first)) != -1) {
+            return false;
+        }
+    }
+    for (; i < len; i++) {
+        if (data[i] != data[0]) return false;
+    }
+    return true;
+}
+
+__attribute__((target("avx2")))
+static bool equal_avx2(const uint8_t *a, const uint8_t *b, size_t len) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        const __m256i va = _mm256_loadu_si256((const __m256i *) (a + i));
+        const __m256i vb = _mm256_loadu_si256((const __m256i *) (b + i));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) != -1) {
+            return false;
+        }
+    }
+    return memcmp(a + i, b + i, len - i) == 0;
+}
+
+__attribute__((target("avx2")))
+static void fill_avx2(uint8_t *data, uint8_t fill, size_t len) {
+    const __m256i v = _mm256_set1_epi8(fill);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        _mm256_storeu_si256((__m256i *) (data + i), v);
+    }
+    memset(data + i, fill, len - i);
+}
+
+__attribute__((target("avx2")))
+static uint64_t hash_avx2(const uint8_t *data, size_t len) {
+    uint64_t acc_words[HASH_LANES];
+    hash_init(acc_words);
+
+    // Each register holds four lanes. The shuffle that swaps neighbouring
+    // lanes works within 128-bit halves, just as for SSE2.
+    __m256i acc[2];
+    for (int j = 0; j < 2; j++) {
+        acc[j] = _mm256_loadu_si256((const __m256i *) (acc_words + 4 * j));
+    }
+    for (size_t stripe = 0; (stripe + 1) * HASH_STRIPE <= len; stripe++) {
+        const uint8_t *p = data + stripe * HASH_STRIPE;
+        const uint64_t *key = HASH_KEY + hash_key_offset(stripe);
+        const __m256i tweak = _mm256_set1_epi64x(hash_stripe_tweak(stripe));
+        for (int j = 0; j < 2; j++) {
+            const __m256i d = _mm256_loadu_si256((const __m256i *) (p + 32 * j));
+            const __m256i k = _mm256_loadu_si256((const __m256i *) (key + 4 * j));
+            const __m256i dk = _mm256_xor_si256(d, _mm256_xor_si256(k, tweak));
+            const __m256i product = _mm256_mul_epu32(dk, _mm256_srli_epi64(dk, 32));
+            const __m256i swapped = _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+            acc[j] = _mm256_add_epi64(acc[j], _mm256_add_epi64(product, swapped));
+        }
+    }
+    for (int j = 0; j < 2; j++) {
+        _mm256_storeu_si256((__m256i *) (acc_words + 4 * j), acc[j]);
+    }
+    return hash_finish(acc_words, data, len);
+}
+
+#endif
+
+const kernel_impl_t KERNEL_IMPLS[] = {
+#ifdef HAVE_X86_KERNELS
+    { "avx2", is_uniform_avx2, equal_avx2, fill_avx2, hash_avx2 },
+    { "sse2", is_uniform_sse2, equal_sse2, fill_sse2, hash_sse2 },
+#endif
+    { "scalar", is_uniform_scalar, equal_scalar, fill_scalar, hash_scalar },
+    { NULL, NULL, NULL, NULL, NULL } // NULL represents end of array.
+};
+
+const kernel_impl_t *current_kernels = NULL;
+
+bool kernel_supported(const kernel_impl_t& impl) {
+    if (impl.name == NULL) return false;
+#ifdef HAVE_X86_KERNELS
+    if (strcmp(impl.name, "avx2") == 0) {
+        return __builtin_cpu_supports("avx2");
+    }
+    if (strcmp(impl.name, "sse2") == 0) {
+        return __builtin_cpu_supports("sse2");
+    }
+#endif
+    return true;
+}
+
+const kernel_impl_t& init_kernels(void) {
+    for (int i = 0; ; i++) {
+        if (kernel_supported(KERNEL_IMPLS[i])) {
+            current_kernels = &KERNEL_IMPLS[i];
+            return *current_kernels;
+        }
+    }
+}
+
+bool select_kernels(const char *name) {
+    for (int i = 0; KERNEL_IMPLS[i].name != NULL; i++) {
+        if (strcmp(KERNEL_IMPLS[i].name, name) == 0) {
+            if (!kernel_supported(KERNEL_IMPLS[i])) {
+                return false;
+            }
+            current_kernels = &KERNEL_IMPLS[i];
+            return true;
+        }
+    }
+    return false;
+}
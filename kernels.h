@@ -0,0 +1,80 @@
+/*
+    kernels.h: fast operations on blocks of sector data
+
+    Copyright (C) 2013 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+    Each operation has a portable version, and SSE2 and AVX2 versions on x86.
+    The best one the CPU supports is picked the first time any of them is
+    used. All versions give identical results -- in particular, data_hash
+    values can be stored and compared between machines.
+*/
+
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    const char *name;
+    // Return whether all len bytes of data are the same.
+    bool (*is_uniform)(const uint8_t *data, size_t len);
+    // Return whether two blocks of data are the same.
+    bool (*equal)(const uint8_t *a, const uint8_t *b, size_t len);
+    // Set len bytes of data to fill.
+    void (*fill)(uint8_t *data, uint8_t fill, size_t len);
+    // Compute a 64-bit fingerprint of some data.
+    uint64_t (*hash)(const uint8_t *data, size_t len);
+} kernel_impl_t;
+
+// All the implementations built in, best first.
+// (The last has name == NULL.)
+extern const kernel_impl_t KERNEL_IMPLS[];
+
+// Return whether the CPU can run an implementation.
+bool kernel_supported(const kernel_impl_t& impl);
+
+// The implementation in use, or NULL if one hasn't been picked yet.
+extern const kernel_impl_t *current_kernels;
+const kernel_impl_t& init_kernels(void);
+
+// Get the implementation in use.
+static inline const kernel_impl_t& kernels(void) {
+    return current_kernels != NULL ? *current_kernels : init_kernels();
+}
+
+// Use a particular implementation, by name. Return false if it isn't
+// supported.
+bool select_kernels(const char *name);
+
+static inline bool data_is_uniform(const uint8_t *data, size_t len) {
+    return kernels().is_uniform(data, len);
+}
+static inline bool data_equal(const uint8_t *a, const uint8_t *b, size_t len) {
+    return kernels().equal(a, b, len);
+}
+static inline void data_fill(uint8_t *data, uint8_t fill, size_t len) {
+    kernels().fill(data, fill, len);
+}
+static inline uint64_t data_hash(const uint8_t *data, size_t len) {
+    return kernels().hash(data, len);
+}
+
+#endif
@@ -0,0 +1,141 @@
+/*
+    kerneltest: check each sector kernel implementation against the scalar one
+
+    Copyright (C) 2013 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include "kernels.h"
+#include "util.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#define ROUNDS 20000
+#define MAX_LEN 1100 // A bit over two 512-byte sectors
+#define MAX_OFFSET 64 // Enough to try every alignment of an AVX2 vector
+
+static int failures = 0;
+
+static void fail(const kernel_impl_t& impl, const char *what, size_t offset,
+                 size_t len) {
+    fprintf(stderr, "%s: %s differs from scalar (offset %zd, length %zd)\n",
+            impl.name, what, offset, len);
+    failures++;
+}
+
+// Run every operation of impl and scalar on the same data, and compare
+// the results.
+static void check_round(const kernel_impl_t& impl, const kernel_impl_t& scalar,
+                        uint64_t& random) {
+    const size_t len = next_random(random) % (MAX_LEN + 1);
+    const size_t offset_a = next_random(random) % MAX_OFFSET;
+    const size_t offset_b = next_random(random) % MAX_OFFSET;
+    std::vector<uint8_t> buf_a(MAX_LEN + MAX_OFFSET), buf_b(MAX_LEN + MAX_OFFSET);
+    uint8_t *a = &buf_a[offset_a];
+    uint8_t *b = &buf_b[offset_b];
+
+    // Mostly uniform data, so is_uniform and equal see both answers, with
+    // a difference (or not) somewhere random.
+    const uint8_t fill = next_random(random);
+    memset(a, fill, len);
+    if (len > 0 && next_random(random) % 2 == 0) {
+        a[next_random(random) % len] ^= 1 << (next_random(random) % 8);
+    }
+    if (next_random(random) % 4 == 0) {
+        for (size_t i = 0; i < len; i++) {
+            a[i] = next_random(random);
+        }
+    }
+    memcpy(b, a, len);
+    if (len > 0 && next_random(random) % 2 == 0) {
+        b[next_random(random) % len] ^= 1 << (next_random(random) % 8);
+    }
+
+    if (impl.is_uniform(a, len) != scalar.is_uniform(a, len)) {
+        fail(impl, "is_uniform", offset_a, len);
+    }
+    if (impl.equal(a, b, len) != scalar.equal(a, b, len)) {
+        fail(impl, "equal", offset_a, len);
+    }
+    if (impl.hash(a, len) != scalar.hash(a, len)) {
+        fail(impl, "hash", offset_a, len);
+    }
+
+    // fill mustn't touch anything outside the block.
+    std::vector<uint8_t> expect(buf_a);
+    memset(&expect[offset_a], fill ^ 0x5A, len);
+    impl.fill(a, fill ^ 0x5A, len);
+    if (buf_a != expect) {
+        fail(impl, "fill", offset_a, len);
+    }
+}
+
+// Swapping two stripes that use the same hash key words (every eighth
+// 64-byte stripe does) must still change the hash.
+static void check_swapped_stripes(const kernel_impl_t& impl,
+                                  uint64_t& random) {
+    const size_t stripe = 64;
+    const size_t len = MAX_LEN;
+    const size_t s = next_random(random) % (len / stripe - 8);
+    std::vector<uint8_t> a(len);
+    for (size_t i = 0; i < len; i++) {
+        a[i] = next_random(random);
+    }
+    std::vector<uint8_t> b(a);
+    std::swap_ranges(b.begin() + s * stripe, b.begin() + (s + 1) * stripe,
+                     b.begin() + (s + 8) * stripe);
+
+    if (impl.hash(&a[0], len) == impl.hash(&b[0], len)) {
+        fprintf(stderr, "%s: hash ignores swapping stripes %zd and %zd\n",
+                impl.name, s, s + 8);
+        failures++;
+    }
+}
+
+int main(void) {
+    const kernel_impl_t *scalar = NULL;
+    for (int i = 0; KERNEL_IMPLS[i].name != NULL; i++) {
+        if (strcmp(KERNEL_IMPLS[i].name, "scalar") == 0) {
+            scalar = &KERNEL_IMPLS[i];
+        }
+    }
+    if (scalar == NULL) {
+        die("No scalar kernels");
+    }
+
+    for (int i = 0; KERNEL_IMPLS[i].name != NULL; i++) {
+        const kernel_impl_t& impl = KERNEL_IMPLS[i];
+        if (!kernel_supported(impl)) {
+            printf("%s: not supported by this CPU, skipped\n", impl.name);
+            continue;
+        }
+
+        uint64_t random = 1;
+        const int before = failures;
+        for (int round = 0; round < ROUNDS; round++) {
+            check_round(impl, *scalar, random);
+            check_swapped_stripes(impl, random);
+        }
+        printf("%s: %s\n", impl.name, failures == before ? "ok" : "FAILED");
+    }
+
+    return failures == 0 ? 0 : 1;
+}
@@ -53,7 +53,7 @@ void show_sector(const sector_t& sector, FILE *out) {
 
 void show_track(const track_t& track, FILE *out) {
     show_mode(track.data_mode, out);
-    fprintf(out, " %dx%d",
+    fprintf(out, " %dx%zu",
             track.num_sectors,
             sector_bytes(track.sector_size_code));
     for (int phys_sec = 0; phys_sec < track.num_sectors; phys_sec++) {
@@ -71,14 +71,14 @@ void show_track_data(const track_t& track, FILE* const out) {
                 track.phys_cyl, track.phys_head, phys_sec,
                 sector.log_cyl, sector.log_head, sector.log_sector);
         if (sector.datas.size() > 1) {
-            fprintf(out, ": (unique read datas: %d)", sector.datas.size());
+            fprintf(out, ": (unique read datas: %zd)", sector.datas.size());
         }
         fprintf(out, ":\n");
 
-        size_t data_id = 0;
-        for (data_map_t::const_iterator iter = sector.datas.begin(); iter != sector.datas.end(); iter++) {
-            if ((sector.datas.size() > 1) || (iter->second > 1)) {
-                fprintf(out, "IMD data id: %zd. Repeat count: %d.\n", data_id++, iter->second);
+        for (size_t data_id = 0; data_id < sector.datas.size(); data_id++) {
+            const uint8_t *data = sector.datas[data_id].data();
+            if ((sector.datas.size() > 1) || (sector.datas[data_id].count > 1)) {
+                fprintf(out, "IMD data id: %zd. Repeat count: %d.\n", data_id, sector.datas[data_id].count);
             }
 
             // The format here is based on "hexdump -C".
@@ -90,7 +90,7 @@ void show_track_data(const track_t& track, FILE* const out) {
                 for (int j = 0; j < line_len; j++) {
                     const int pos = i + j;
                     if (pos < data_len) {
-                        fprintf(out, " %02x", iter->first[pos]);
+                        fprintf(out, " %02x", data[pos]);
                     } else {
                         fprintf(out, "   ");
                     }
@@ -100,7 +100,7 @@ void show_track_data(const track_t& track, FILE* const out) {
                 for (int j = 0; j < line_len; j++) {
                     const int pos = i + j;
                     if (pos < data_len) {
-                        const uint8_t c = iter->first[pos];
+                        const uint8_t c = data[pos];
                         if (c >= 32 && c < 127) {
                             fprintf(out, "%c", c);
                         } else {
@@ -119,6 +119,17 @@ void show_track_data(const track_t& track, FILE* const out) {
     }
 }
 
+void show_track_line(const track_t& track, bool with_data, FILE *out) {
+    fprintf(out, "%2d.%d:", track.phys_cyl, track.phys_head);
+    show_track(track, out);
+    fprintf(out, "\n");
+
+    if (with_data) {
+        fprintf(out, "\n");
+        show_track_data(track, out);
+    }
+}
+
 void show_comment(const disk_t& disk, FILE *out) {
     if (!disk.comment.empty()) {
         fwrite(disk.comment.c_str(), 1, disk.comment.length(), out);
@@ -130,14 +141,15 @@ void show_disk(const disk_t& disk, bool with_data, FILE *out) {
     fprintf(out, "\n");
     for (int phys_cyl = 0; phys_cyl < disk.num_phys_cyls; phys_cyl++) {
         for (int phys_head = 0; phys_head < disk.num_phys_heads; phys_head++) {
-            fprintf(out, "%2d.%d:", phys_cyl, phys_head);
-            show_track(disk.tracks[phys_cyl][phys_head], out);
-            fprintf(out, "\n");
-
-            if (with_data) {
-                fprintf(out, "\n");
-                show_track_data(disk.tracks[phys_cyl][phys_head], out);
+            // Tracks that weren't in the image are shown as unknown.
+            track_t blank;
+            const track_t *track = find_track(disk, phys_cyl, phys_head);
+            if (track == NULL) {
+                init_track(phys_cyl, phys_head, blank);
+                track = &blank;
             }
+
+            show_track_line(*track, with_data, out);
         }
     }
 }
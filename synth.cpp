@@ -0,0 +1,178 @@
+/*
+    synth.cpp: generate synthetic disks for testing and benchmarking
+
+    Copyright (C) 2013 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include "disk.h"
+#include "kernels.h"
+#include "synth.h"
+#include "util.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+const char SYNTH_USAGE[] =
+    "  -c CYLS    cylinders (default 80)\n"
+    "  -h HEADS   heads (default 2)\n"
+    "  -n SECS    sectors per track (default 18)\n"
+    "  -z CODE    sector size code, 0 = 128 bytes (default 2)\n"
+    "  -M MODE    data mode name (default MFM-500k)\n"
+    "  -f FRAC    fraction of sectors filled with one byte (default 0.25)\n"
+    "  -b FRAC    fraction of sectors with bad CRCs (default 0.02)\n"
+    "  -v NUM     distinct reads of each bad sector (default 3)\n"
+    "  -s SEED    random seed (default 1)\n";
+
+void init_synth_params(synth_params_t& params) {
+    params.cyls = 80;
+    params.heads = 2;
+    params.sectors = 18;
+    params.size_code = 2;
+    params.mode = find_data_mode(3); // MFM-500k
+    params.fill_fraction = 0.25;
+    params.bad_fraction = 0.02;
+    params.variants = 3;
+    params.seed = 1;
+}
+
+static int parse_int(const char *arg, int low, int high) {
+    char *end;
+    long value = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || value < low || value > high) {
+        die("Bad value %s (must be %d to %d)", arg, low, high);
+    }
+    return value;
+}
+
+static double parse_fraction(const char *arg) {
+    char *end;
+    double value = strtod(arg, &end);
+    if (*arg == '\0' || *end != '\0' || value < 0.0 || value > 1.0) {
+        die("Bad fraction %s (must be 0 to 1)", arg);
+    }
+    return value;
+}
+
+bool parse_synth_option(int opt, const char *arg, synth_params_t& params) {
+    switch (opt) {
+    case 'c':
+        params.cyls = parse_int(arg, 1, MAX_CYLS);
+        break;
+    case 'h':
+        params.heads = parse_int(arg, 1, MAX_HEADS);
+        break;
+    case 'n':
+        params.sectors = parse_int(arg, 1, MAX_SECS - 1);
+        break;
+    case 'z':
+        params.size_code = parse_int(arg, 0, 6);
+        break;
+    case 'M':
+        params.mode = NULL;
+        for (int i = 0; DATA_MODES[i].name != NULL; i++) {
+            if (strcmp(DATA_MODES[i].name, arg) == 0) {
+                params.mode = &DATA_MODES[i];
+            }
+        }
+        if (params.mode == NULL) {
+            die("Unknown data mode %s", arg);
+        }
+        break;
+    case 'f':
+        params.fill_fraction = parse_fraction(arg);
+        break;
+    case 'b':
+        params.bad_fraction = parse_fraction(arg);
+        break;
+    case 'v':
+        params.variants = parse_int(arg, 1, 255);
+        break;
+    case 's':
+        params.seed = strtoull(arg, NULL, 10);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+static void random_data(uint64_t& state, uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i += 8) {
+        uint64_t value = next_random(state);
+        for (size_t j = i; j < len && j < i + 8; j++) {
+            data[j] = value;
+            value >>= 8;
+        }
+    }
+}
+
+void make_synth_disk(const synth_params_t& params, disk_t& disk) {
+    init_disk(disk);
+    make_disk_comment("synthetic", "disk", disk);
+    disk.num_phys_cyls = params.cyls;
+    disk.num_phys_heads = params.heads;
+
+    uint64_t state = params.seed * 0x9E3779B97F4A7C15ULL + 1;
+    const size_t sector_size = sector_bytes(params.size_code);
+    std::vector<uint8_t> data(sector_size);
+
+    for (int cyl = 0; cyl < params.cyls; cyl++) {
+        for (int head = 0; head < params.heads; head++) {
+            track_t& track = disk_track(disk, cyl, head);
+            track.status = TRACK_PROBED;
+            track.data_mode = params.mode;
+            track.sector_size_code = params.size_code;
+            resize_track(track, params.sectors);
+
+            for (int phys_sec = 0; phys_sec < params.sectors; phys_sec++) {
+                sector_t& sector = track.sectors[phys_sec];
+                sector.log_cyl = cyl;
+                sector.log_head = head;
+                sector.log_sector = phys_sec + 1;
+
+                if (random_fraction(state) < params.fill_fraction) {
+                    data_fill(&data[0], next_random(state), sector_size);
+                } else {
+                    random_data(state, &data[0], sector_size);
+                }
+
+                if (random_fraction(state) >= params.bad_fraction) {
+                    record_good_read(sector, &data[0], sector_size, false, false);
+                    continue;
+                }
+
+                // Each bad read differs from the first in a few bytes, and
+                // was seen a few times.
+                for (int i = 0; i < params.variants; i++) {
+                    std::vector<uint8_t> variant(data);
+                    if (i > 0) {
+                        for (int j = 0; j < 4; j++) {
+                            variant[next_random(state) % sector_size] ^= 1 << (j + i % 4);
+                        }
+                    }
+                    const int count = 1 + next_random(state) % 3;
+                    for (int j = 0; j < count; j++) {
+                        record_bad_read(sector, &variant[0], sector_size, false);
+                    }
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,54 @@
+/*
+    synth.h: generate synthetic disks for testing and benchmarking
+
+    Copyright (C) 2013 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include "disk.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct {
+    int cyls;
+    int heads;
+    int sectors; // per track, with logical IDs starting at 1
+    int size_code;
+    const data_mode_t *mode;
+    double fill_fraction; // Sectors that are all one byte
+    double bad_fraction; // Sectors read with bad CRCs
+    int variants; // Distinct data read from each bad sector
+    uint64_t seed;
+} synth_params_t;
+
+// Set the defaults: a 1.44M disk, with a few bad sectors.
+void init_synth_params(synth_params_t& params);
+
+// Handle a command-line option that sets a parameter. Return false if opt
+// isn't one of SYNTH_OPTIONS.
+#define SYNTH_OPTIONS "c:h:n:z:M:f:b:v:s:"
+bool parse_synth_option(int opt, const char *arg, synth_params_t& params);
+// Describe the options, for a usage message.
+extern const char SYNTH_USAGE[];
+
+// Generate a disk. The same parameters always give the same disk.
+void make_synth_disk(const synth_params_t& params, disk_t& disk);
+
+#endif
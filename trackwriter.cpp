@@ -0,0 +1,107 @@
+/*
+    trackwriter.cpp: write tracks to an image in the background
+
+    Copyright (C) 2013 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include "imd.h"
+#include "trackwriter.h"
+#include "util.h"
+
+#include <errno.h>
+
+// Wait on a semaphore, carrying on if a signal interrupts the wait.
+static void wait_sem(sem_t *sem) {
+    while (sem_wait(sem) != 0) {
+        if (errno != EINTR) {
+            die_errno("sem_wait failed");
+        }
+    }
+}
+
+static void *track_writer_main(void *arg) {
+    track_writer_t& writer = *(track_writer_t *) arg;
+
+    // A write error mustn't exit the whole program; it's passed back to
+    // the reader instead.
+    throw_fatal_errors();
+    bool stopped = false;
+
+    while (true) {
+        wait_sem(&writer.filled);
+        const track_t *track = writer.queue[writer.head];
+        writer.head = (writer.head + 1) % TRACK_QUEUE_SIZE;
+        sem_post(&writer.free);
+
+        if (track == NULL) break;
+        if (stopped) continue;
+        try {
+            write_imd_track_fd(*track, writer.fd, writer.buf);
+        } catch (const fatal_error_t& error) {
+            writer.error = error.message;
+            writer.failed = true;
+            stopped = true;
+        }
+    }
+
+    return NULL;
+}
+
+// If the writer has failed, die() with its message. The flag is cleared
+// first, so each failure is only reported once.
+static void check_writer(track_writer_t& writer) {
+    if (writer.failed) {
+        writer.failed = false;
+        die("%s", writer.error.c_str());
+    }
+}
+
+// Put a track (or NULL) in the queue, waiting for a free slot.
+static void push_track(track_writer_t& writer, const track_t *track) {
+    wait_sem(&writer.free);
+    writer.queue[writer.tail] = track;
+    writer.tail = (writer.tail + 1) % TRACK_QUEUE_SIZE;
+    sem_post(&writer.filled);
+}
+
+void start_track_writer(int fd, track_writer_t& writer) {
+    writer.fd = fd;
+    writer.head = 0;
+    writer.tail = 0;
+    writer.failed = false;
+    writer.error.clear();
+    if (sem_init(&writer.filled, 0, 0) != 0
+        || sem_init(&writer.free, 0, TRACK_QUEUE_SIZE) != 0) {
+        die_errno("sem_init failed");
+    }
+    if (pthread_create(&writer.thread, NULL, track_writer_main, &writer) != 0) {
+        die("cannot create writer thread");
+    }
+}
+
+void queue_track(track_writer_t& writer, const track_t& track) {
+    check_writer(writer);
+    push_track(writer, &track);
+}
+
+void finish_track_writer(track_writer_t& writer) {
+    push_track(writer, NULL);
+    pthread_join(writer.thread, NULL);
+    sem_destroy(&writer.filled);
+    sem_destroy(&writer.free);
+    check_writer(writer);
+}
@@ -0,0 +1,79 @@
+/*
+    trackwriter.h: write tracks to an image in the background
+
+    Copyright (C) 2013 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+    While dumpfloppy reads a disk, each track it's finished with is passed
+    to a writer thread, which encodes it and appends it to the image, so
+    the drive doesn't sit idle waiting for the filesystem. Tracks go
+    through a fixed-size ring with one producer and one consumer, so
+    neither side takes a lock; the reader only waits if the writer gets
+    TRACK_QUEUE_SIZE tracks behind.
+*/
+
+#ifndef TRACKWRITER_H
+#define TRACKWRITER_H
+
+#include "disk.h"
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#define TRACK_QUEUE_SIZE 16
+
+typedef struct {
+    int fd;
+    pthread_t thread;
+
+    // Tracks waiting to be written. A NULL track tells the writer to stop.
+    // Only the reader touches tail and only the writer touches head; the
+    // semaphores count the filled and free slots.
+    const track_t *queue[TRACK_QUEUE_SIZE];
+    size_t head, tail;
+    sem_t filled, free;
+
+    std::vector<uint8_t> buf;
+
+    // Set by the writer if writing a track dies, with the message in error.
+    // It writes nothing more after that, but still takes tracks from the
+    // queue so the reader doesn't wait forever.
+    std::atomic<bool> failed;
+    std::string error;
+} track_writer_t;
+
+// Start a writer thread appending tracks to fd.
+void start_track_writer(int fd, track_writer_t& writer);
+
+// Queue a track to be written. The track mustn't be changed until
+// finish_track_writer has returned. If the writer has failed, die() with
+// its message instead.
+void queue_track(track_writer_t& writer, const track_t& track);
+
+// Wait for all the queued tracks to be written, and stop the thread. If the
+// writer failed and that hasn't been passed on by queue_track yet, die()
+// with its message once the thread has stopped.
+void finish_track_writer(track_writer_t& writer);
+
+#endif
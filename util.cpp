@@ -23,16 +23,102 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+
+static thread_local bool fatal_errors_thrown = false;
+
+void throw_fatal_errors(void) {
+    fatal_errors_thrown = true;
+}
 
 void die(const char *format, ...) {
     va_list ap;
     va_start(ap, format);
+    if (fatal_errors_thrown) {
+        char *buf;
+        const int len = vasprintf(&buf, format, ap);
+        va_end(ap);
+        fatal_error_t error;
+        if (len == -1) {
+            error.message = format;
+        } else {
+            error.message.assign(buf, len);
+            free(buf);
+        }
+        throw error;
+    }
     vfprintf(stderr, format, ap);
     va_end(ap);
     fputc('\n', stderr);
     exit(1);
 }
 
+void write_all(int fd, const void *data, size_t len) {
+    const char *pos = (const char *) data;
+    while (len > 0) {
+        ssize_t count = write(fd, pos, len);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            die_errno("write failed");
+        }
+        pos += count;
+        len -= count;
+    }
+}
+
+bool read_whole_file(const char *filename, std::vector<uint8_t>& contents) {
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        if (errno == ENOENT) {
+            return false;
+        }
+        die_errno("cannot open %s", filename);
+    }
+
+    contents.clear();
+    while (true) {
+        uint8_t buf[65536];
+        size_t count = fread(buf, 1, sizeof buf, f);
+        contents.insert(contents.end(), buf, buf + count);
+        if (count < sizeof buf) break;
+    }
+    if (ferror(f)) {
+        die_errno("read from %s failed", filename);
+    }
+    fclose(f);
+    return true;
+}
+
+void put_be32(std::vector<uint8_t>& buf, uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        buf.push_back(value >> shift);
+    }
+}
+
+void put_be64(std::vector<uint8_t>& buf, uint64_t value) {
+    put_be32(buf, value >> 32);
+    put_be32(buf, value);
+}
+
+uint32_t get_be32(const uint8_t *data) {
+    return (uint32_t(data[0]) << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+uint64_t get_be64(const uint8_t *data) {
+    return (uint64_t(get_be32(data)) << 32) | get_be32(data + 4);
+}
+
+uint64_t next_random(uint64_t& state) {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ULL;
+}
+
+double random_fraction(uint64_t& state) {
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
 std::string str_sprintf(const char *format, ...) {
     va_list ap;
 
@@ -23,13 +23,43 @@
 
 #include <errno.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <string>
+#include <vector>
 
 void die(const char *format, ...);
 #define die_errno(format, ...) \
     die(format ": %s", ##__VA_ARGS__, strerror(errno))
 
+// A fatal error, thrown by die() in a thread that's asked for them.
+typedef struct {
+    std::string message;
+} fatal_error_t;
+
+// From now on, make die() in the calling thread throw a fatal_error_t
+// rather than printing the message and exiting -- so a thread working on
+// one of several jobs can give up on that job and carry on with the rest.
+void throw_fatal_errors(void);
+
+// Write all of a buffer to a file descriptor, or die.
+void write_all(int fd, const void *data, size_t len);
+
+// Read the whole of a file. Return false if it doesn't exist.
+bool read_whole_file(const char *filename, std::vector<uint8_t>& contents);
+
+// Append big-endian integers to a buffer, and read them back.
+void put_be32(std::vector<uint8_t>& buf, uint32_t value);
+void put_be64(std::vector<uint8_t>& buf, uint64_t value);
+uint32_t get_be32(const uint8_t *data);
+uint64_t get_be64(const uint8_t *data);
+
+// Return the next number from a xorshift64* generator, so the same seed
+// gives the same sequence everywhere. state must not start as 0.
+uint64_t next_random(uint64_t& state);
+// Return a random number in [0, 1).
+double random_fraction(uint64_t& state);
+
 // malloc a string (of the right size) and printf into it.
 // (Similar to GNU asprintf.)
 std::string str_sprintf(const char *format, ...);